@@ -1,6 +1,7 @@
 #include "AParamStat.h"
 #include "Ranking.h"
 #include "IndirectSort.h"
+#include "Scratch.h"
 
 using namespace std;
 
@@ -8,17 +9,13 @@ float spearman(const vector<float> &v1, const vector<float> &v2,
 				vector<float> &rank1, vector<float> &rank2,
 				double &pv)
 {
-	list<int> ids;
-	int max_i = v1.size();
-	for(int i = 0; i < max_i; i++) {
-		ids.push_back(i);
-	}
-	ids.sort<IndirectSort<float> >(IndirectSort<float>(v1));
+	ScratchVector<int> ids;
+	indirect_sort(*ids, v1);
 	rank1.resize(v1.size());
-	cond_mid_ranking(rank1, ids, v1, v2);
-	ids.sort<IndirectSort<float> >(IndirectSort<float>(v2));
+	cond_mid_ranking(rank1, *ids, v1, v2);
+	indirect_sort(*ids, v2);
 	rank2.resize(v2.size());
-	cond_mid_ranking(rank2, ids, v2, v1);
+	cond_mid_ranking(rank2, *ids, v2, v1);
 
 	vector<float>::iterator r1 = rank1.begin();
 	vector<float>::iterator r2 = rank2.begin();
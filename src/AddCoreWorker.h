@@ -7,30 +7,40 @@
 
 #include <RcppParallel.h>
 #include "KMeansCenterBase.h"
+#include "KMeansData.h"
+#include "Cancellation.h"
+#include "Scratch.h"
 #include <vector>
 
 class AddCoreWorker : public RcppParallel::Worker {
 private:
-    const std::vector<std::vector<float>>& data;
+    const KMeansData& data;
     KMeansCenterBase* center;
     const std::vector<int>& assignment;
-    std::vector<std::pair<float, int>>& core_dist;
+    std::vector<float>& core_dist;
+    const CancellationToken* token;
 
 public:
-    AddCoreWorker(const std::vector<std::vector<float>>& data,
+    AddCoreWorker(const KMeansData& data,
                   KMeansCenterBase* center,
                   const std::vector<int>& assignment,
-                  std::vector<std::pair<float, int>>& core_dist)
-        : data(data), center(center), assignment(assignment), core_dist(core_dist) {}
+                  std::vector<float>& core_dist,
+                  const CancellationToken* token = nullptr)
+        : data(data), center(center), assignment(assignment), core_dist(core_dist), token(token) {}
 
     void operator()(std::size_t begin, std::size_t end) {
+        ScratchVector<float> scratch;
+        std::vector<float> &buf = *scratch;
         for (std::size_t i = begin; i < end; i++) {
+            if (token && token->cancelled()) {
+                return;
+            }
             if (assignment[i] == -1) {
-                float dist = center->dist(data[i]);
-                core_dist[i] = std::make_pair(dist, (int)i);
+                float dist = center->dist(data.row(i, buf), data.na_mask(i));
+                core_dist[i] = dist;
             } else {
                 // Assigned points get max distance (sorted to end)
-                core_dist[i] = std::make_pair(REAL_MAX, (int)i);
+                core_dist[i] = REAL_MAX;
             }
         }
     }
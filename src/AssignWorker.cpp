@@ -0,0 +1,60 @@
+#include "AssignWorker.h"
+#include "Scratch.h"
+
+using namespace std;
+
+AssignWorker::AssignWorker(const KMeansData& data,
+                           const vector<KMeansCenterBase*>& centers,
+                           vector<int>& assignment,
+                           vector<float>& dist,
+                           const KMeansCenterIndex* index,
+                           AssignmentMargins* margins,
+                           bool keep_assignment,
+                           const CancellationToken* token)
+    : data(data), centers(centers), assignment(assignment), dist(dist), index(index), margins(margins),
+      keep_assignment(keep_assignment), token(token) {}
+
+void AssignWorker::operator()(std::size_t begin, std::size_t end) {
+    ScratchVector<float> scratch;
+    vector<float> &buf = *scratch;
+    for (std::size_t i = begin; i < end; i++) {
+        if (token && token->interrupted()) {
+            return;
+        }
+        int best_id_i = -1;
+        float best_dist = REAL_MAX;
+
+        const vector<float>& x = data.row(i, buf);
+        const uint64_t* x_na = data.na_mask(i);
+        if (margins) {
+            int second = -1;
+            float second_dist = REAL_MAX;
+            best_id_i = nearest_two(centers, index, x, x_na, best_dist, second, second_dist);
+            if (keep_assignment && best_id_i != assignment[i]) {
+                // The runner up of a row which is not in its closest center is the closest one
+                second = best_id_i;
+                second_dist = best_dist;
+                best_id_i = assignment[i];
+                best_dist = centers[best_id_i]->dist(x, x_na);
+            }
+            margins->set(i, best_dist, second, second_dist);
+        } else if (index) {
+            best_id_i = index->nearest(x, x_na, best_dist);
+        } else {
+            for (size_t j = 0; j < centers.size(); j++) {
+                float d = centers[j]->dist(x, x_na);
+                if (d < best_dist) {
+                    best_dist = d;
+                    best_id_i = j;
+                }
+            }
+        }
+
+        if (keep_assignment) {
+            continue;
+        }
+        // Rows without overlap with any center go to cluster 0, as in ReassignWorker
+        assignment[i] = best_id_i == -1 ? 0 : best_id_i;
+        dist[i] = best_dist;
+    }
+}
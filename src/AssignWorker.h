@@ -0,0 +1,41 @@
+#ifndef ASSIGNWORKER_H
+#define ASSIGNWORKER_H
+
+#include <RcppParallel.h>
+#include "KMeansCenterBase.h"
+#include "KMeansData.h"
+#include "KMeansCenterIndex.h"
+#include "AssignmentMargins.h"
+#include "Cancellation.h"
+#include <vector>
+
+// AssignWorker labels every row by its closest center without voting.
+// Used to project rows that did not take part in clustering (e.g. rows outside a coreset).
+// With keep_assignment the given assignment is kept, and only the margins of its centers are computed.
+// Rows are skipped once the token is interrupted by the user (a time out does not stop it, as every row needs a
+// label).
+class AssignWorker : public RcppParallel::Worker {
+private:
+    const KMeansData& data;
+    const std::vector<KMeansCenterBase*>& centers;
+    std::vector<int>& assignment;
+    std::vector<float>& dist;
+    const KMeansCenterIndex* index;
+    AssignmentMargins* margins;
+    bool keep_assignment;
+    const CancellationToken* token;
+
+public:
+    AssignWorker(const KMeansData& data,
+                 const std::vector<KMeansCenterBase*>& centers,
+                 std::vector<int>& assignment,
+                 std::vector<float>& dist,
+                 const KMeansCenterIndex* index = nullptr,
+                 AssignmentMargins* margins = nullptr,
+                 bool keep_assignment = false,
+                 const CancellationToken* token = nullptr);
+
+    void operator()(std::size_t begin, std::size_t end) override;
+};
+
+#endif // ASSIGNWORKER_H
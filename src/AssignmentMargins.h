@@ -0,0 +1,59 @@
+//
+// Distances of every row to its center and to the runner up center
+//
+
+#ifndef TGLKMEANS_ASSIGNMENTMARGINS_H
+#define TGLKMEANS_ASSIGNMENTMARGINS_H
+
+#include <vector>
+#include "KMeansCenterBase.h"
+#include "KMeansCenterIndex.h"
+
+// Filled by the pass that assigns the rows (the last reassign of a run, or the labeling of all the
+// rows by the coreset centers), so that the confidence of every assignment comes without another
+// scan over the centers. second is -1 (and second_dist REAL_MAX) when no other center overlaps the row.
+struct AssignmentMargins {
+    std::vector<float> dist;
+    std::vector<int> second;
+    std::vector<float> second_dist;
+
+    void resize(size_t n) {
+        dist.assign(n, REAL_MAX);
+        second.assign(n, -1);
+        second_dist.assign(n, REAL_MAX);
+    }
+
+    void set(size_t i, float best_dist, int second_i, float second_i_dist) {
+        dist[i] = best_dist;
+        second[i] = second_i;
+        second_dist[i] = second_i_dist;
+    }
+};
+
+// The closest and second closest centers to x (-1 if there is none), through the index when given
+inline int nearest_two(const std::vector<KMeansCenterBase *> &centers, const KMeansCenterIndex *index,
+                       const std::vector<float> &x, const uint64_t *x_na,
+                       float &best_dist, int &second, float &second_dist) {
+    if (index) {
+        return index->nearest(x, x_na, best_dist, second, second_dist);
+    }
+    int best = -1;
+    best_dist = REAL_MAX;
+    second = -1;
+    second_dist = REAL_MAX;
+    for (size_t j = 0; j < centers.size(); j++) {
+        float dist = centers[j]->dist(x, x_na);
+        if (dist < best_dist) {
+            second = best;
+            second_dist = best_dist;
+            best_dist = dist;
+            best = j;
+        } else if (dist < second_dist) {
+            second_dist = dist;
+            second = j;
+        }
+    }
+    return best;
+}
+
+#endif //TGLKMEANS_ASSIGNMENTMARGINS_H
@@ -0,0 +1,78 @@
+//
+// Cooperative cancellation of the parallel phases (user interrupts and time limits)
+//
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <Rcpp.h>
+#include "Cancellation.h"
+
+using namespace std;
+
+static const chrono::milliseconds POLL_INTERVAL(50);
+
+CancellationToken::CancellationToken(double time_limit) :
+        m_state(RUNNING),
+        m_has_deadline(time_limit > 0) {
+    if (m_has_deadline) {
+        m_deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(time_limit));
+    }
+}
+
+static void check_interrupt_fn(void *) {
+    R_CheckUserInterrupt();
+}
+
+bool CancellationToken::poll() {
+    if (cancelled()) {
+        return true;
+    }
+    // R_CheckUserInterrupt jumps on a pending interrupt, R_ToplevelExec stops the jump here
+    if (!R_ToplevelExec(check_interrupt_fn, nullptr)) {
+        m_state.store(INTERRUPTED);
+    } else if (m_has_deadline && chrono::steady_clock::now() >= m_deadline) {
+        m_state.store(TIMED_OUT);
+    }
+    return cancelled();
+}
+
+void CancellationToken::check_interrupt() {
+    poll();
+    if (interrupted()) {
+        throw Rcpp::internal::InterruptedException();
+    }
+}
+
+void run_cancellable(CancellationToken &token, const function<void()> &work) {
+    mutex m;
+    condition_variable cv;
+    bool done = false;
+    exception_ptr error;
+
+    thread worker([&]() {
+        try {
+            work();
+        } catch (...) {
+            error = current_exception();
+        }
+        lock_guard<mutex> lock(m);
+        done = true;
+        cv.notify_one();
+    });
+
+    {
+        unique_lock<mutex> lock(m);
+        while (!cv.wait_for(lock, POLL_INTERVAL, [&]() { return done; })) {
+            lock.unlock();
+            token.poll();
+            lock.lock();
+        }
+    }
+    worker.join();
+
+    if (error) {
+        rethrow_exception(error);
+    }
+}
@@ -0,0 +1,45 @@
+//
+// Cooperative cancellation of the parallel phases (user interrupts and time limits)
+//
+
+#ifndef TGLKMEANS_CANCELLATION_H
+#define TGLKMEANS_CANCELLATION_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+// Workers check cancelled() inside their chunks (a relaxed atomic load) and return early once it is set.
+// Only the R thread calls poll(), which looks for a pending R interrupt and checks the deadline.
+class CancellationToken {
+protected:
+    enum State { RUNNING = 0, INTERRUPTED = 1, TIMED_OUT = 2 };
+
+    std::atomic<int> m_state;
+
+    bool m_has_deadline;
+
+    std::chrono::steady_clock::time_point m_deadline;
+
+public:
+    // time_limit is in seconds, no limit if it is not positive
+    CancellationToken(double time_limit = 0);
+
+    bool cancelled() const { return m_state.load(std::memory_order_relaxed) != RUNNING; }
+
+    bool interrupted() const { return m_state.load(std::memory_order_relaxed) == INTERRUPTED; }
+
+    bool timed_out() const { return m_state.load(std::memory_order_relaxed) == TIMED_OUT; }
+
+    // R thread only. Returns cancelled().
+    bool poll();
+
+    // R thread only: polls and turns a user interrupt into an R interrupt
+    void check_interrupt();
+};
+
+// Runs work (which may launch parallel phases) on a helper thread, while the calling R thread polls
+// the token. Exceptions thrown by work are rethrown on the calling thread.
+void run_cancellable(CancellationToken &token, const std::function<void()> &work);
+
+#endif //TGLKMEANS_CANCELLATION_H
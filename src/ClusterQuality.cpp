@@ -0,0 +1,286 @@
+//
+// Quality indices of a clustering (silhouette, Davies-Bouldin, Calinski-Harabasz)
+//
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include "ClusterQuality.h"
+#include "AssignmentMargins.h"
+#include "KMeans.h"
+#include "KMeansCenterFactory.h"
+#include "Parallel.h"
+#include "Scratch.h"
+
+using namespace std;
+
+static const double NOT_AVAILABLE = numeric_limits<double>::quiet_NaN();
+
+// (b - a) / max(a, b), 0 when there is no other cluster or both are 0
+static double silhouette_of(double a, double b, bool has_b) {
+    double denom = max(a, b);
+    return has_b && denom > 0 ? (b - a) / denom : 0;
+}
+
+// Per cluster sums of the distances of the rows to their centers, the simplified silhouette and the
+// per dimension sums of the data (for the center of all the rows)
+class QualityWorker : public RcppParallel::Worker {
+public:
+    const KMeansData &data;
+    const vector<KMeansCenterBase *> &centers;
+    const vector<int> &assignment;
+    const AssignmentMargins &margins;
+
+    vector<double> count;
+    vector<double> dissimilarity;
+    vector<double> cost;
+    double silhouette;
+    size_t silhouette_n;
+    vector<double> dim_sum;
+    vector<double> dim_count;
+
+    QualityWorker(const KMeansData &data, const vector<KMeansCenterBase *> &centers, const vector<int> &assignment,
+                  const AssignmentMargins &margins)
+        : data(data), centers(centers), assignment(assignment), margins(margins),
+          count(centers.size(), 0), dissimilarity(centers.size(), 0), cost(centers.size(), 0),
+          silhouette(0), silhouette_n(0), dim_sum(data.dim(), 0), dim_count(data.dim(), 0) {}
+
+    QualityWorker(const QualityWorker &other, RcppParallel::Split)
+        : QualityWorker(other.data, other.centers, other.assignment, other.margins) {}
+
+    void operator()(size_t begin, size_t end) override {
+        ScratchVector<float> scratch;
+        vector<float> &buf = *scratch;
+        for (size_t i = begin; i < end; i++) {
+            float dist = margins.dist[i];
+            if (dist == REAL_MAX) {
+                continue;
+            }
+            int clust = assignment[i];
+            const KMeansCenterBase *center = centers[clust];
+            double a = center->dissimilarity(dist);
+            count[clust]++;
+            dissimilarity[clust] += a;
+            cost[clust] += center->cost(dist);
+
+            bool has_b = margins.second[i] >= 0;
+            double b = has_b ? center->dissimilarity(margins.second_dist[i]) : 0;
+            silhouette += silhouette_of(a, b, has_b);
+            silhouette_n++;
+
+            const vector<float> &x = data.row(i, buf);
+            const uint64_t *x_na = data.na_mask(i);
+            for (size_t d = 0; d < x.size(); d++) {
+                if (x_na == nullptr || !na_bit(x_na, d)) {
+                    dim_sum[d] += x[d];
+                    dim_count[d]++;
+                }
+            }
+        }
+    }
+
+    void join(const QualityWorker &other) {
+        for (size_t c = 0; c < count.size(); c++) {
+            count[c] += other.count[c];
+            dissimilarity[c] += other.dissimilarity[c];
+            cost[c] += other.cost[c];
+        }
+        silhouette += other.silhouette;
+        silhouette_n += other.silhouette_n;
+        for (size_t d = 0; d < dim_sum.size(); d++) {
+            dim_sum[d] += other.dim_sum[d];
+            dim_count[d] += other.dim_count[d];
+        }
+    }
+};
+
+// The worst ratio (s_i + s_j) / d(c_i, c_j) of every cluster i
+class DaviesBouldinWorker : public RcppParallel::Worker {
+public:
+    const vector<KMeansCenterBase *> &centers;
+    const vector<vector<float>> &coords;
+    const vector<double> &scatter;  // negative for empty clusters
+    vector<double> &worst;
+
+    DaviesBouldinWorker(const vector<KMeansCenterBase *> &centers, const vector<vector<float>> &coords,
+                        const vector<double> &scatter, vector<double> &worst)
+        : centers(centers), coords(coords), scatter(scatter), worst(worst) {}
+
+    void operator()(size_t begin, size_t end) override {
+        for (size_t i = begin; i < end; i++) {
+            if (scatter[i] < 0) {
+                continue;
+            }
+            for (size_t j = 0; j < centers.size(); j++) {
+                if (j == i || scatter[j] < 0) {
+                    continue;
+                }
+                float dist = centers[i]->dist(coords[j]);
+                double separation = dist == REAL_MAX ? 0 : centers[i]->dissimilarity(dist);
+                // Coinciding centers do not count, as in the usual definition
+                if (separation > 0) {
+                    worst[i] = max(worst[i], (scatter[i] + scatter[j]) / separation);
+                }
+            }
+        }
+    }
+};
+
+// Silhouette of every sample row relative to the other sample rows
+class SilhouetteWorker : public RcppParallel::Worker {
+public:
+    const vector<vector<float>> &rows;
+    const vector<const uint64_t *> &na;
+    const vector<int> &clust;  // -1 for rows without a center
+    const string &metric;
+    size_t k;
+    double silhouette;
+    size_t silhouette_n;
+
+    SilhouetteWorker(const vector<vector<float>> &rows, const vector<const uint64_t *> &na, const vector<int> &clust,
+                     const string &metric, size_t k)
+        : rows(rows), na(na), clust(clust), metric(metric), k(k), silhouette(0), silhouette_n(0) {}
+
+    SilhouetteWorker(const SilhouetteWorker &other, RcppParallel::Split)
+        : SilhouetteWorker(other.rows, other.na, other.clust, other.metric, other.k) {}
+
+    void operator()(size_t begin, size_t end) override {
+        vector<unique_ptr<KMeansCenterBase>> owned;
+        vector<KMeansCenterBase *> point;
+        create_centers(metric, 1, rows.empty() ? 0 : rows[0].size(), owned, point);
+        vector<double> sum(k);
+        vector<double> count(k);
+        for (size_t p = begin; p < end; p++) {
+            if (clust[p] < 0) {
+                continue;
+            }
+            // A center at the row measures the distances from it with the metric
+            point[0]->reset_votes();
+            point[0]->vote(rows[p], 1, na[p]);
+            point[0]->init_to_votes();
+
+            fill(sum.begin(), sum.end(), 0);
+            fill(count.begin(), count.end(), 0);
+            for (size_t q = 0; q < rows.size(); q++) {
+                if (q == p || clust[q] < 0) {
+                    continue;
+                }
+                float dist = point[0]->dist(rows[q], na[q]);
+                if (dist != REAL_MAX) {
+                    sum[clust[q]] += point[0]->dissimilarity(dist);
+                    count[clust[q]]++;
+                }
+            }
+
+            silhouette_n++;
+            if (count[clust[p]] == 0) {
+                // Single rows of their cluster have a silhouette of 0
+                continue;
+            }
+            double a = sum[clust[p]] / count[clust[p]];
+            double b = REAL_MAX;
+            for (size_t c = 0; c < k; c++) {
+                if ((int) c != clust[p] && count[c] > 0) {
+                    b = min(b, sum[c] / count[c]);
+                }
+            }
+            silhouette += silhouette_of(a, b, b != REAL_MAX);
+        }
+    }
+
+    void join(const SilhouetteWorker &other) {
+        silhouette += other.silhouette;
+        silhouette_n += other.silhouette_n;
+    }
+};
+
+ClusterQuality cluster_quality(const KMeansData &data, vector<KMeansCenterBase *> &centers, const string &metric,
+                               vector<int> &assignment, const vector<size_t> &sample) {
+    ClusterQuality quality;
+    size_t k = centers.size();
+    size_t dim = data.dim();
+
+    // Pass 1: distances to the own and the closest other center
+    AssignmentMargins margins;
+    KMeans::assignment_margins(data, centers, assignment, margins);
+
+    // Pass 2: per cluster sums, the simplified silhouette and the center of all the rows
+    QualityWorker worker(data, centers, assignment, margins);
+    Parallel::parallel_reduce(0, data.size(), worker, Parallel::grain(data.size(), 4.0 * dim));
+    quality.simplified_silhouette = worker.silhouette_n > 0 ? worker.silhouette / worker.silhouette_n : NOT_AVAILABLE;
+
+    vector<vector<float>> coords(k);
+    for (size_t c = 0; c < k; c++) {
+        coords[c] = centers[c]->report_vector();
+    }
+    size_t n = 0;
+    size_t k_used = 0;
+    vector<double> scatter(k, -1);
+    for (size_t c = 0; c < k; c++) {
+        if (worker.count[c] > 0) {
+            scatter[c] = worker.dissimilarity[c] / worker.count[c];
+            n += worker.count[c];
+            k_used++;
+        }
+    }
+
+    // Davies-Bouldin, over the pairs of centers
+    if (k_used >= 2) {
+        vector<double> worst(k, 0);
+        DaviesBouldinWorker db(centers, coords, scatter, worst);
+        Parallel::parallel_for(0, k, db, Parallel::grain(k, k * centers[0]->dist_cost()));
+        double total = 0;
+        for (size_t c = 0; c < k; c++) {
+            total += scatter[c] >= 0 ? worst[c] : 0;
+        }
+        quality.davies_bouldin = total / k_used;
+    } else {
+        quality.davies_bouldin = NOT_AVAILABLE;
+    }
+
+    // Calinski-Harabasz, with the dispersions measured by the metric cost
+    vector<unique_ptr<KMeansCenterBase>> owned_global;
+    vector<KMeansCenterBase *> global;
+    create_centers(metric, 1, dim, owned_global, global);
+    vector<float> mean(dim, REAL_MAX);
+    for (size_t d = 0; d < dim; d++) {
+        if (worker.dim_count[d] > 0) {
+            mean[d] = worker.dim_sum[d] / worker.dim_count[d];
+        }
+    }
+    global[0]->vote(mean, 1);
+    global[0]->init_to_votes();
+    double within = 0;
+    double between = 0;
+    for (size_t c = 0; c < k; c++) {
+        if (worker.count[c] == 0) {
+            continue;
+        }
+        within += worker.cost[c];
+        float dist = global[0]->dist(coords[c]);
+        if (dist != REAL_MAX) {
+            between += worker.count[c] * global[0]->cost(dist);
+        }
+    }
+    if (k_used >= 2 && n > k_used && within > 0) {
+        quality.calinski_harabasz = (between / (k_used - 1)) / (within / (n - k_used));
+    } else {
+        quality.calinski_harabasz = NOT_AVAILABLE;
+    }
+
+    // Silhouette of the sample, on decoded copies of its rows
+    vector<vector<float>> rows(sample.size());
+    vector<const uint64_t *> na(sample.size());
+    vector<int> clust(sample.size());
+    vector<float> buf;
+    for (size_t p = 0; p < sample.size(); p++) {
+        rows[p] = data.row(sample[p], buf);
+        na[p] = data.na_mask(sample[p]);
+        clust[p] = margins.dist[sample[p]] == REAL_MAX ? -1 : assignment[sample[p]];
+    }
+    SilhouetteWorker silhouette(rows, na, clust, metric, k);
+    Parallel::parallel_reduce(0, sample.size(), silhouette, Parallel::grain(sample.size(), sample.size() * centers[0]->dist_cost()));
+    quality.silhouette = silhouette.silhouette_n > 0 ? silhouette.silhouette / silhouette.silhouette_n : NOT_AVAILABLE;
+
+    return quality;
+}
@@ -0,0 +1,37 @@
+//
+// Quality indices of a clustering (silhouette, Davies-Bouldin, Calinski-Harabasz)
+//
+
+#ifndef TGLKMEANS_CLUSTERQUALITY_H
+#define TGLKMEANS_CLUSTERQUALITY_H
+
+#include <string>
+#include <vector>
+#include "KMeansCenterBase.h"
+#include "KMeansData.h"
+
+// All the indices use the distances of the clustering metric, with its NA semantics. The silhouette and
+// Davies-Bouldin indices use dissimilarity() (the euclid distance, or 1 - correlation) and the
+// Calinski-Harabasz index uses cost() (the squared euclid distance, or 1 - correlation).
+struct ClusterQuality {
+    // Mean of (b - a) / max(a, b) over the rows, where a is the distance to the row's center and b the
+    // distance to the closest other center. Exact, in two passes over the rows.
+    double simplified_silhouette;
+
+    // Mean silhouette of the sample rows, computed within the sample (quadratic in its size)
+    double silhouette;
+
+    // Mean over the clusters of max over the other clusters of (s_i + s_j) / d(c_i, c_j), where s_i is the
+    // mean distance of the rows of cluster i to its center (lower is better)
+    double davies_bouldin;
+
+    // Between clusters dispersion / within clusters dispersion, scaled by (n - k) / (k - 1)
+    double calinski_harabasz;
+};
+
+// centers are the centers of the clusters in assignment, which are left with their coordinates
+// (a row with no overlap with any center is skipped)
+ClusterQuality cluster_quality(const KMeansData &data, std::vector<KMeansCenterBase *> &centers, const std::string &metric,
+                               std::vector<int> &assignment, const std::vector<size_t> &sample);
+
+#endif //TGLKMEANS_CLUSTERQUALITY_H
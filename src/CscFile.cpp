@@ -0,0 +1,145 @@
+//
+// A binary file format for sparse count matrices, read and written a block of columns at a time
+//
+
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include "CscFile.h"
+
+using namespace std;
+
+static const char CSC_MAGIC[8] = {'T', 'G', 'L', 'C', 'S', 'C', '0', '1'};
+
+// Whether count items of item_size bytes starting at offset end before file_size (and after the header)
+static bool section_fits(int64_t offset, int64_t count, size_t item_size, int64_t file_size) {
+    if (offset < int64_t(sizeof(CscHeader)) || offset > file_size) {
+        return false;
+    }
+    return count <= (file_size - offset) / int64_t(item_size);
+}
+
+CscFileReader::CscFileReader(const string &path) : m_path(path), m_file(path, ios::binary) {
+    if (!m_file) {
+        throw runtime_error("cannot open " + path);
+    }
+    if (!m_file.read(reinterpret_cast<char *>(&m_header), sizeof(m_header)) ||
+        memcmp(m_header.magic, CSC_MAGIC, sizeof(CSC_MAGIC)) != 0) {
+        throw runtime_error(path + " is not a CSC matrix file");
+    }
+    // ncol + 1 column offsets are read, so ncol must leave room for one more
+    if (m_header.nrow < 0 || m_header.ncol < 0 || m_header.nnz < 0 || m_header.ncol == numeric_limits<int64_t>::max()) {
+        throw runtime_error(path + " has an invalid header");
+    }
+
+    // Both sections must lie inside the file (compared by division, so corrupt sizes cannot overflow)
+    m_file.seekg(0, ios::end);
+    int64_t file_size = m_file.tellg();
+    if (!section_fits(m_header.entries_offset, m_header.nnz, sizeof(CscEntry), file_size) ||
+        !section_fits(m_header.p_offset, m_header.ncol + 1, sizeof(int64_t), file_size)) {
+        throw runtime_error(path + " is truncated");
+    }
+
+    m_p.resize(m_header.ncol + 1);
+    m_file.seekg(m_header.p_offset);
+    if (!m_file.read(reinterpret_cast<char *>(m_p.data()), m_p.size() * sizeof(int64_t))) {
+        throw runtime_error(path + " is truncated");
+    }
+    if (m_p.front() != 0 || m_p.back() != m_header.nnz) {
+        throw runtime_error(path + " has invalid column offsets");
+    }
+    for (size_t col = 0; col < size_t(m_header.ncol); ++col) {
+        if (m_p[col + 1] < m_p[col]) {
+            throw runtime_error(path + " has invalid column offsets");
+        }
+    }
+}
+
+vector<pair<size_t, size_t>> CscFileReader::plan_blocks(size_t block_nnz) const {
+    vector<pair<size_t, size_t>> blocks;
+    size_t ncol = m_header.ncol;
+    size_t first = 0;
+    while (first < ncol) {
+        size_t end = first + 1;
+        while (end < ncol && size_t(m_p[end + 1] - m_p[first]) <= block_nnz) {
+            ++end;
+        }
+        blocks.emplace_back(first, end);
+        first = end;
+    }
+    return blocks;
+}
+
+void CscFileReader::read_block(size_t first_col, size_t end_col, CscBlock &block) {
+    block.first_col = first_col;
+    block.end_col = end_col;
+    block.p.resize(end_col - first_col + 1);
+    for (size_t col = first_col; col <= end_col; ++col) {
+        block.p[col - first_col] = m_p[col] - m_p[first_col];
+    }
+
+    size_t nnz = block.p.back();
+    m_entries.resize(nnz);
+    m_file.seekg(m_header.entries_offset + m_p[first_col] * int64_t(sizeof(CscEntry)));
+    if (!m_file.read(reinterpret_cast<char *>(m_entries.data()), nnz * sizeof(CscEntry))) {
+        throw runtime_error(m_path + " is truncated");
+    }
+
+    // The values of a column are downsampled in place, so they are kept apart from the rows
+    block.i.resize(nnz);
+    block.x.resize(nnz);
+    // The rows of every column must be strictly increasing, as in a dgCMatrix
+    for (size_t col = 0; col < block.ncol(); ++col) {
+        int64_t prev_row = -1;
+        for (int64_t idx = block.p[col]; idx < block.p[col + 1]; ++idx) {
+            const CscEntry &entry = m_entries[idx];
+            if (entry.row < 0 || entry.row >= m_header.nrow) {
+                throw runtime_error(m_path + " has a row index out of range");
+            }
+            if (entry.row <= prev_row) {
+                throw runtime_error(m_path + " has unsorted row indices");
+            }
+            prev_row = entry.row;
+            block.i[idx] = entry.row;
+            block.x[idx] = entry.value;
+        }
+    }
+}
+
+CscFileWriter::CscFileWriter(const string &path, int64_t nrow) : m_path(path), m_file(path, ios::binary | ios::trunc) {
+    if (!m_file) {
+        throw runtime_error("cannot create " + path);
+    }
+    memcpy(m_header.magic, CSC_MAGIC, sizeof(CSC_MAGIC));
+    m_header.nrow = nrow;
+    m_header.ncol = 0;
+    m_header.nnz = 0;
+    m_header.entries_offset = sizeof(CscHeader);
+    m_header.p_offset = 0;
+    m_p.push_back(0);
+
+    // The header is written again by finish()
+    m_file.write(reinterpret_cast<const char *>(&m_header), sizeof(m_header));
+}
+
+void CscFileWriter::append(const vector<int64_t> &col_nnz, const vector<CscEntry> &entries) {
+    for (int64_t nnz : col_nnz) {
+        m_p.push_back(m_p.back() + nnz);
+    }
+    if (!m_file.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(CscEntry))) {
+        throw runtime_error("cannot write to " + m_path);
+    }
+}
+
+void CscFileWriter::finish() {
+    m_header.ncol = m_p.size() - 1;
+    m_header.nnz = m_p.back();
+    m_header.p_offset = m_header.entries_offset + m_header.nnz * int64_t(sizeof(CscEntry));
+    m_file.write(reinterpret_cast<const char *>(m_p.data()), m_p.size() * sizeof(int64_t));
+    m_file.seekp(0);
+    m_file.write(reinterpret_cast<const char *>(&m_header), sizeof(m_header));
+    m_file.close();
+    if (!m_file) {
+        throw runtime_error("cannot write to " + m_path);
+    }
+}
@@ -0,0 +1,92 @@
+//
+// A binary file format for sparse count matrices, read and written a block of columns at a time
+//
+
+#ifndef TGLKMEANS_CSCFILE_H
+#define TGLKMEANS_CSCFILE_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The layout of a file (native byte order):
+//   header      CscHeader
+//   entries     nnz (row, value) int32 pairs, column after column
+//   p           ncol + 1 int64 offsets of the columns in the entries
+// The header holds the byte offsets of the two sections, so the entries can be streamed out before the
+// column offsets are known. A value of NA_INTEGER is an NA.
+struct CscHeader {
+    char magic[8];
+    int64_t nrow;
+    int64_t ncol;
+    int64_t nnz;
+    int64_t entries_offset;
+    int64_t p_offset;
+};
+
+struct CscEntry {
+    int32_t row;
+    int32_t value;
+};
+
+// A block of consecutive columns, with p relative to the first entry of the block
+struct CscBlock {
+    size_t first_col = 0;
+    size_t end_col = 0;
+    std::vector<int64_t> p;
+    std::vector<int32_t> i;
+    std::vector<int32_t> x;
+
+    size_t ncol() const { return end_col - first_col; }
+};
+
+// Errors (missing, truncated, foreign or corrupt files) are thrown as std::runtime_error
+class CscFileReader {
+private:
+    std::string m_path;
+    std::ifstream m_file;
+    CscHeader m_header;
+    std::vector<int64_t> m_p;
+    std::vector<CscEntry> m_entries;
+
+public:
+    explicit CscFileReader(const std::string &path);
+
+    int64_t nrow() const { return m_header.nrow; }
+
+    int64_t ncol() const { return m_header.ncol; }
+
+    int64_t nnz() const { return m_header.nnz; }
+
+    // Offsets of the columns in the entries
+    const std::vector<int64_t> &p() const { return m_p; }
+
+    // Splits the columns into blocks of about block_nnz entries (at least a column each), as [first, end) pairs
+    std::vector<std::pair<size_t, size_t>> plan_blocks(size_t block_nnz) const;
+
+    // Reads the columns [first_col, end_col) into block, checking that the rows of every column are in range and
+    // strictly increasing
+    void read_block(size_t first_col, size_t end_col, CscBlock &block);
+};
+
+class CscFileWriter {
+private:
+    std::string m_path;
+    std::ofstream m_file;
+    CscHeader m_header;
+    std::vector<int64_t> m_p;
+
+public:
+    CscFileWriter(const std::string &path, int64_t nrow);
+
+    // Appends the next columns. col_nnz has the number of entries of every column, and entries the entries of all
+    // of them, in order.
+    void append(const std::vector<int64_t> &col_nnz, const std::vector<CscEntry> &entries);
+
+    // Writes the column offsets and the header
+    void finish();
+};
+
+#endif //TGLKMEANS_CSCFILE_H
@@ -1,10 +1,13 @@
 #include <vector>
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <random>
 #include <Rcpp.h>
 #include <RcppParallel.h>
 #include "DownsampleWorker.h"
+#include "Scratch.h"
+#include "Span.h"
 
 typedef float float32_t;
 typedef double float64_t;
@@ -17,7 +20,7 @@ ceil_power_of_two(const size_t size) {
 }
 
 template<typename D>
-static void initialize_tree(const std::vector<D>& input, std::vector<size_t>& tree) {
+static void initialize_tree(const Span<const D>& input, std::vector<size_t>& tree) {
     assert(input.size() >= 2); 
 
     size_t input_size = ceil_power_of_two(input.size());
@@ -80,8 +83,120 @@ static size_t random_sample(std::vector<size_t>& tree, ssize_t random) {
     }
 }
 
+// Uniform double in [0, 1) from the top 53 bits, the same on every platform
+static float64_t random_unit(std::mt19937_64& random) {
+    return float64_t(random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Number of successes in draws from a population of total items, successes of which are successes.
+// The probabilities are built by their ratios outward from the mode, until they are negligible relative
+// to it, so a draw costs O(standard deviation) and no factorials are evaluated.
+static int64_t random_hypergeometric(int64_t total, int64_t successes, int64_t draws, std::mt19937_64& random,
+                                     std::vector<float64_t>& weights) {
+    const int64_t lo = std::max(int64_t(0), draws - (total - successes));
+    const int64_t hi = std::min(draws, successes);
+    if (lo == hi) {
+        return lo;
+    }
+
+    // p(x + 1) / p(x)
+    auto ratio = [&](int64_t x) {
+        return (float64_t(successes - x) * float64_t(draws - x)) /
+               (float64_t(x + 1) * float64_t(total - successes - draws + x + 1));
+    };
+    const float64_t negligible = 1e-18;
+
+    int64_t mode = int64_t((float64_t(draws + 1) * float64_t(successes + 1)) / float64_t(total + 2));
+    mode = std::min(hi, std::max(lo, mode));
+
+    // weights[j] is p(first + j) / p(mode)
+    int64_t first = mode;
+    float64_t weight = 1;
+    weights.clear();
+    while (first > lo) {
+        weight /= ratio(first - 1);
+        if (weight < negligible) {
+            break;
+        }
+        weights.push_back(weight);
+        --first;
+    }
+    std::reverse(weights.begin(), weights.end());
+    weights.push_back(1);
+    weight = 1;
+    for (int64_t x = mode; x < hi; ++x) {
+        weight *= ratio(x);
+        if (weight < negligible) {
+            break;
+        }
+        weights.push_back(weight);
+    }
+
+    float64_t sum = 0;
+    for (float64_t w : weights) {
+        sum += w;
+    }
+    float64_t u = random_unit(random) * sum;
+    for (size_t j = 0; j < weights.size(); ++j) {
+        u -= weights[j];
+        if (u < 0) {
+            return first + int64_t(j);
+        }
+    }
+    return first + int64_t(weights.size()) - 1;
+}
+
+// Draws the samples of every entry in turn, conditioned on the samples and total left after the entries before it
+template<typename D, typename O>
+static void sample_slice(const Span<const D>& input, const Span<O>& output, int64_t total, const int32_t samples,
+                         std::mt19937_64& random, std::vector<size_t>&, std::vector<float64_t>& weights) {
+    std::fill(output.begin(), output.end(), O(0));
+    int64_t samples_left = samples;
+    for (size_t index = 0; index < input.size() && samples_left > 0; ++index) {
+        int64_t count = input[index];
+        if (count <= 0) {
+            continue;
+        }
+        int64_t sampled = count == total ? samples_left : random_hypergeometric(total, count, samples_left, random, weights);
+        output[index] = O(sampled);
+        samples_left -= sampled;
+        total -= count;
+    }
+}
+
+// A position in [0, total). minstd_rand draws 31 bits, so larger totals (counts above 2^31 in a column) combine two draws.
+static size_t random_position(std::minstd_rand& random, size_t total) {
+    const uint64_t range = uint64_t(std::minstd_rand::max()) + 1;
+    if (total < range) {
+        return random() % total;
+    }
+    uint64_t high = random();
+    uint64_t low = random();
+    return (high * range + low) % total;
+}
+
+// Draws the samples one at a time from the sum tree, removing each one from it
 template<typename D, typename O>
-static void downsample_slice(const std::vector<D>& input, std::vector<O>& output, const int32_t samples, const size_t random_seed) {
+static void sample_slice(const Span<const D>& input, const Span<O>& output, int64_t, const int32_t samples,
+                         std::minstd_rand& random, std::vector<size_t>& tree, std::vector<float64_t>&) {
+    initialize_tree(input, tree);
+    size_t& total = tree[tree.size() - 1];
+
+    std::fill(output.begin(), output.end(), O(0));
+    for (size_t index = 0; index < static_cast<size_t>(samples); ++index) {
+        size_t sampled_index = random_sample(tree, random_position(random, total));
+        if (sampled_index < output.size()) {
+            ++output[sampled_index];
+        }
+    }
+}
+
+// Downsamples input into output (both may be columns of R objects), drawing from random, whose type selects the
+// sampler: std::minstd_rand for the tree, std::mt19937_64 for the hypergeometric one. tree and weights are the buffers
+// of the samplers, leased once per chunk of columns, so that they grow to the largest column and are then reused.
+template<typename D, typename O, typename Random>
+static void downsample_slice(const Span<const D>& input, const Span<O>& output, const int32_t samples, Random& random,
+                             std::vector<size_t>& tree, std::vector<float64_t>& weights) {
     assert(output.size() == input.size()); 
 
     if (samples < 0 || input.size() == 0) {
@@ -93,60 +208,231 @@ static void downsample_slice(const std::vector<D>& input, std::vector<O>& output
         return;
     }
 
-    size_t input_size = ceil_power_of_two(input.size());
-    std::vector<size_t> tree(2 * input_size - 1);
-    initialize_tree(input, tree);
-    size_t& total = tree[tree.size() - 1];
-
-    if (total <= static_cast<size_t>(samples)) {
+    int64_t total = 0;
+    for (const D& value : input) {
+        total += int64_t(value);
+    }
+    if (total <= static_cast<int64_t>(samples)) {
         std::copy(input.begin(), input.end(), output.begin());
         return;
     }
 
-    std::fill(output.begin(), output.end(), O(0));
+    sample_slice(input, output, total, samples, random, tree, weights);
+}
 
-    std::minstd_rand random(random_seed);
-    for (size_t index = 0; index < static_cast<size_t>(samples); ++index) {
-        size_t sampled_index = random_sample(tree, random() % total);
-        if (sampled_index < output.size()) {
-            ++output[sampled_index];
+// The per thread buffers of the column kernels, for input counts of type D
+template<typename D>
+struct DownsampleBuffers {
+    ScratchVector<size_t> tree;
+    ScratchVector<float64_t> weights;
+    ScratchVector<D> masked;
+    ScratchVector<size_t> order;
+};
+
+static bool is_na(int value) {
+    return value == NA_INTEGER;
+}
+
+static bool is_na(float64_t value) {
+    return std::isnan(value);
+}
+
+// Downsamples a column to each of targets into the matching outputs, from the largest target down, each level
+// sampled from the level above it with the same random stream, so that every level is a subsample of the larger
+// ones (the largest level is the same as downsampling to it alone). NA entries are left out of the sampling (as
+// zeros) and NA in every output, and only columns with NAs are copied. Returns the sum of the non NA entries.
+template<typename D, typename Random>
+static float64_t downsample_column_levels(const Span<const D>& input, const Span<const Span<int>>& outputs,
+                                          const Span<const int>& targets, Random& random, DownsampleBuffers<D>& buffers) {
+    float64_t sum = 0;
+    bool has_na = false;
+    for (D value : input) {
+        if (is_na(value)) {
+            has_na = true;
+        } else {
+            sum += int64_t(value);
+        }
+    }
+
+    Span<const D> source = input;
+    if (has_na) {
+        buffers.masked->assign(input.begin(), input.end());
+        for (D& value : *buffers.masked) {
+            if (is_na(value)) {
+                value = 0;
+            }
         }
+        source = Span<const D>(*buffers.masked);
+    }
+
+    std::vector<size_t>& order = *buffers.order;
+    order.resize(targets.size());
+    for (size_t level = 0; level < order.size(); ++level) {
+        order[level] = level;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return targets[a] > targets[b]; });
+
+    if (order.empty()) {
+        return sum;
+    }
+
+    // The largest level is sampled from the input, and every other level from the level above it
+    downsample_slice(source, outputs[order[0]], targets[order[0]], random, *buffers.tree, *buffers.weights);
+    for (size_t rank = 1; rank < order.size(); ++rank) {
+        const Span<int>& above = outputs[order[rank - 1]];
+        downsample_slice(Span<const int>(above.begin(), above.end()), outputs[order[rank]], targets[order[rank]], random,
+                         *buffers.tree, *buffers.weights);
     }
+
+    if (has_na) {
+        for (size_t index = 0; index < input.size(); ++index) {
+            if (is_na(input[index])) {
+                for (const Span<int>& output : outputs) {
+                    output[index] = NA_INTEGER;
+                }
+            }
+        }
+    }
+    return sum;
 }
 
-DownsampleWorker::DownsampleWorker(const Rcpp::IntegerMatrix& input, Rcpp::IntegerMatrix& output, int samples, unsigned int random_seed)
-    : input_matrix(input), output_matrix(output), samples(samples), random_seed(random_seed) {}
+template<typename D>
+static float64_t downsample_column(const Span<const D>& input, const Span<const Span<int>>& outputs, const Span<const int>& targets,
+                                   const size_t random_seed, DownsampleMethod method, DownsampleBuffers<D>& buffers) {
+    if (method == DownsampleMethod::hypergeometric) {
+        std::mt19937_64 random(random_seed);
+        return downsample_column_levels(input, outputs, targets, random, buffers);
+    }
+    std::minstd_rand random(random_seed);
+    return downsample_column_levels(input, outputs, targets, random, buffers);
+}
 
-void DownsampleWorker::operator()(std::size_t begin, std::size_t end) {
-    for (std::size_t col = begin; col < end; ++col) {        
-        std::vector<int> input_vec(input_matrix.column(col).begin(), input_matrix.column(col).end());
-        std::vector<int> output_vec(input_vec.size(), 0);
+DownsampleMethod parse_downsample_method(const std::string &method) {
+    if (method == "tree") {
+        return DownsampleMethod::tree;
+    }
+    if (method == "hypergeometric") {
+        return DownsampleMethod::hypergeometric;
+    }
+    Rcpp::stop("unknown downsample method: " + method);
+}
 
-        downsample_slice(input_vec, output_vec, samples, random_seed + col);
+float64_t downsample_column_cost(int64_t entries, int target, DownsampleMethod method) {
+    if (entries <= 1) {
+        return 16;
+    }
+    // Every entry counts at least 1, so a column is sampled to at least min(target, entries) samples
+    float64_t samples = std::min<float64_t>(std::max(target, 0), entries);
+    if (method == DownsampleMethod::hypergeometric) {
+        // Seeding mt19937_64 fills its 312 words of state
+        return 1000 + 8.0 * entries + samples;
+    }
+    return 16 + 2.0 * entries + samples * std::max(1.0, log2(float64_t(entries)));
+}
+
+template<typename D>
+DownsampleWorker<D>::DownsampleWorker(const RcppParallel::RMatrix<D>& input, const Rcpp::IntegerMatrix& targets,
+                                      std::vector<Rcpp::IntegerMatrix>& outputs, Rcpp::NumericVector& out_sums,
+                                      unsigned int random_seed, DownsampleMethod method)
+    : input_matrix(input), targets(targets), output_sums(out_sums), random_seed(random_seed), method(method) {
+    for (Rcpp::IntegerMatrix& output : outputs) {
+        output_matrices.emplace_back(output);
+    }
+}
 
-        std::copy(output_vec.begin(), output_vec.end(), output_matrix.column(col).begin());
+template<typename D>
+void DownsampleWorker<D>::operator()(std::size_t begin, std::size_t end) {
+    DownsampleBuffers<D> buffers;
+    std::vector<Span<int>> outputs(output_matrices.size());
+    for (std::size_t col = begin; col < end; ++col) {
+        typename RcppParallel::RMatrix<D>::Column input = input_matrix.column(col);
+        for (size_t level = 0; level < outputs.size(); ++level) {
+            RcppParallel::RMatrix<int>::Column output = output_matrices[level].column(col);
+            outputs[level] = Span<int>(output.begin(), output.end());
+        }
+        RcppParallel::RMatrix<int>::Column column_targets = targets.column(col);
+        output_sums[col] = downsample_column(Span<const D>(input.begin(), input.end()), Span<const Span<int>>(outputs),
+                                             Span<const int>(column_targets.begin(), column_targets.end()), random_seed + col,
+                                             method, buffers);
     }
 }
 
-DownsampleWorkerSparse::DownsampleWorkerSparse(const Rcpp::IntegerVector& i, const Rcpp::IntegerVector& p, const Rcpp::IntegerVector& x,
-                                               Rcpp::IntegerVector& out_x, int samples, unsigned int random_seed)
-    : input_i(i), input_p(p), input_x(x), output_x(out_x), samples(samples), random_seed(random_seed) {}
+template class DownsampleWorker<int>;
+template class DownsampleWorker<float64_t>;
+
+DownsampleWorkerSparse::DownsampleWorkerSparse(const Rcpp::IntegerVector& i, const Rcpp::IntegerVector& p, const Rcpp::NumericVector& x,
+                                               const Rcpp::IntegerMatrix& targets, std::vector<Rcpp::IntegerVector>& out_x,
+                                               std::vector<Rcpp::IntegerVector>& out_nnz, Rcpp::NumericVector& out_sums,
+                                               unsigned int random_seed, DownsampleMethod method)
+    : input_i(i), input_p(p), input_x(x), targets(targets), output_sums(out_sums), random_seed(random_seed), method(method) {
+    for (size_t level = 0; level < out_x.size(); ++level) {
+        output_x.emplace_back(out_x[level]);
+        output_nnz.emplace_back(out_nnz[level]);
+    }
+}
 
 void DownsampleWorkerSparse::operator()(std::size_t begin, std::size_t end) {
+    DownsampleBuffers<float64_t> buffers;
+    std::vector<Span<int>> outputs(output_x.size());
     for (std::size_t col = begin; col < end; ++col) {
-        // Extract the current column from the sparse matrix
-        std::vector<int> input_vec;
-        for (int idx = input_p[col]; idx < input_p[col + 1]; ++idx) {
-            input_vec.push_back(input_x[idx]);
+        // The non zero values of the column, in place in the input and output x slots
+        size_t first = input_p[col];
+        size_t size = input_p[col + 1] - input_p[col];
+        for (size_t level = 0; level < outputs.size(); ++level) {
+            outputs[level] = Span<int>(output_x[level].begin() + first, size);
         }
+        RcppParallel::RMatrix<int>::Column column_targets = targets.column(col);
+        output_sums[col] = downsample_column(Span<const float64_t>(input_x.begin() + first, size), Span<const Span<int>>(outputs),
+                                             Span<const int>(column_targets.begin(), column_targets.end()), random_seed + col,
+                                             method, buffers);
 
-        std::vector<int> output_vec(input_vec.size(), 0);
+        for (size_t level = 0; level < outputs.size(); ++level) {
+            int nnz = 0;
+            for (int value : outputs[level]) {
+                nnz += value != 0;
+            }
+            output_nnz[level][col + 1] = nnz;
+        }
+    }
+}
+
+DownsampleBlockWorker::DownsampleBlockWorker(const CscBlock& block, std::vector<int32_t>& out_x, std::vector<int64_t>& out_nnz,
+                                             std::vector<double>& out_sums, int samples, unsigned int random_seed,
+                                             DownsampleMethod method)
+    : block(block), output_x(out_x), output_nnz(out_nnz), output_sums(out_sums), samples(samples), random_seed(random_seed),
+      method(method) {}
+
+void DownsampleBlockWorker::operator()(std::size_t begin, std::size_t end) {
+    DownsampleBuffers<int> buffers;
+    for (std::size_t col = begin; col < end; ++col) {
+        size_t first = block.p[col];
+        size_t size = block.p[col + 1] - block.p[col];
+        Span<int> output(output_x.data() + first, size);
+        size_t matrix_col = block.first_col + col;
+        output_sums[matrix_col] = downsample_column(Span<const int>(block.x.data() + first, size), Span<const Span<int>>(&output, 1),
+                                                    Span<const int>(&samples, 1), random_seed + matrix_col, method, buffers);
 
-        downsample_slice(input_vec, output_vec, samples, random_seed + col);
+        int64_t nnz = 0;
+        for (int value : output) {
+            nnz += value != 0;
+        }
+        output_nnz[col + 1] = nnz;
+    }
+}
 
-        // Store results in the output sparse matrix
-        for (int idx = input_p[col], out_idx = 0; idx < input_p[col + 1]; ++idx, ++out_idx) {
-            output_x[idx] = output_vec[out_idx];
+CompactSparseWorker::CompactSparseWorker(const Rcpp::IntegerVector& i, const Rcpp::IntegerVector& p, const Rcpp::IntegerVector& values,
+                                         const Rcpp::IntegerVector& out_p, Rcpp::IntegerVector& out_i, Rcpp::NumericVector& out_x)
+    : input_i(i), input_p(p), values(values), output_p(out_p), output_i(out_i), output_x(out_x) {}
+
+void CompactSparseWorker::operator()(std::size_t begin, std::size_t end) {
+    for (std::size_t col = begin; col < end; ++col) {
+        int out_idx = output_p[col];
+        for (int idx = input_p[col]; idx < input_p[col + 1]; ++idx) {
+            if (values[idx] != 0) {
+                output_i[out_idx] = input_i[idx];
+                output_x[out_idx] = values[idx] == NA_INTEGER ? NA_REAL : values[idx];
+                ++out_idx;
+            }
         }
     }
 }
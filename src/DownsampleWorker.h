@@ -3,38 +3,108 @@
 
 #include <Rcpp.h>
 #include <RcppParallel.h>
+#include <string>
 #include <vector>
+#include "CscFile.h"
 
+// How the samples of a column are drawn. tree draws them one by one from a sum tree over the entries
+// (O(samples * log(entries)), the original sampler). hypergeometric draws the count of every entry
+// from the conditional hypergeometric distribution of the samples left, O(entries + sqrt(samples))
+// per column. Both are reproducible for a given seed and column, but give different samples.
+enum class DownsampleMethod { tree, hypergeometric };
+
+DownsampleMethod parse_downsample_method(const std::string &method);
+
+// Estimated arithmetic operations of downsampling a column of the given number of (non zero) entries to a target,
+// used to balance the columns across the threads
+double downsample_column_cost(int64_t entries, int target, DownsampleMethod method);
+
+// Downsamples every column to one or more targets (levels). targets has a row per level and a column per input
+// column, and outputs a matrix per level. The levels of a column are nested: each is sampled from the next larger
+// one with the same random stream. NA entries are not sampled and stay NA in the outputs. out_sums gets the sum of
+// the non NA entries of every column.
+// D is the type of the input counts, int or double (read in place, so double counts may exceed 2^31, and
+// fractions are truncated). The downsampled counts are at most the targets, so the outputs are int.
+template<typename D>
 class DownsampleWorker : public RcppParallel::Worker {
 private:
-    RcppParallel::RMatrix<int> input_matrix;
-    RcppParallel::RMatrix<int> output_matrix;
-    int samples;
+    RcppParallel::RMatrix<D> input_matrix;
+    RcppParallel::RMatrix<int> targets;
+    std::vector<RcppParallel::RMatrix<int>> output_matrices;
+    RcppParallel::RVector<double> output_sums;
     unsigned int random_seed;
+    DownsampleMethod method;
 
 public:    
-    DownsampleWorker(const Rcpp::IntegerMatrix& input, Rcpp::IntegerMatrix& output, int samples, unsigned int random_seed);
+    DownsampleWorker(const RcppParallel::RMatrix<D>& input, const Rcpp::IntegerMatrix& targets, std::vector<Rcpp::IntegerMatrix>& outputs,
+                     Rcpp::NumericVector& out_sums, unsigned int random_seed, DownsampleMethod method = DownsampleMethod::tree);
 
     // Parallel operator
     void operator()(std::size_t begin, std::size_t end) override;
 };
 
+// The same for the columns of a dgCMatrix, whose double x slot is read in place. out_x[level] gets the downsampled
+// value of every stored entry, and out_nnz[level][col + 1] the number of entries of column col that are still non zero.
 class DownsampleWorkerSparse : public RcppParallel::Worker {
 private:
-    Rcpp::IntegerVector input_i;
-    Rcpp::IntegerVector input_p;
-    Rcpp::IntegerVector input_x;
-    Rcpp::IntegerVector output_x;
-    int samples;
+    RcppParallel::RVector<int> input_i;
+    RcppParallel::RVector<int> input_p;
+    RcppParallel::RVector<double> input_x;
+    RcppParallel::RMatrix<int> targets;
+    std::vector<RcppParallel::RVector<int>> output_x;
+    std::vector<RcppParallel::RVector<int>> output_nnz;
+    RcppParallel::RVector<double> output_sums;
     unsigned int random_seed;
+    DownsampleMethod method;
 
 public:
-    DownsampleWorkerSparse(const Rcpp::IntegerVector& i, const Rcpp::IntegerVector& p, const Rcpp::IntegerVector& x, 
-                           Rcpp::IntegerVector& out_x, int samples, unsigned int random_seed);
+    DownsampleWorkerSparse(const Rcpp::IntegerVector& i, const Rcpp::IntegerVector& p, const Rcpp::NumericVector& x,
+                           const Rcpp::IntegerMatrix& targets, std::vector<Rcpp::IntegerVector>& out_x,
+                           std::vector<Rcpp::IntegerVector>& out_nnz, Rcpp::NumericVector& out_sums, unsigned int random_seed,
+                           DownsampleMethod method = DownsampleMethod::tree);
 
     // Parallel operator
     void operator()(std::size_t begin, std::size_t end) override;
 };
 
+// Downsamples a block of the columns of a CSC file to a single target, seeding every column by its index in the
+// whole matrix, so that the result is the same as downsampling the matrix in memory. out_x gets the downsampled value
+// of every entry of the block, out_nnz[col + 1] the number of entries of the col'th column of the block that are
+// still non zero, and out_sums[block.first_col + col] the sum of its non NA entries.
+class DownsampleBlockWorker : public RcppParallel::Worker {
+private:
+    const CscBlock& block;
+    std::vector<int32_t>& output_x;
+    std::vector<int64_t>& output_nnz;
+    std::vector<double>& output_sums;
+    int samples;
+    unsigned int random_seed;
+    DownsampleMethod method;
+
+public:
+    DownsampleBlockWorker(const CscBlock& block, std::vector<int32_t>& out_x, std::vector<int64_t>& out_nnz,
+                          std::vector<double>& out_sums, int samples, unsigned int random_seed, DownsampleMethod method);
+
+    void operator()(std::size_t begin, std::size_t end) override;
+};
+
+// Copies the non zero entries of the downsampled columns to the compacted i and x slots, at the column
+// offsets given by the prefix sum out_p of the non zero counts
+class CompactSparseWorker : public RcppParallel::Worker {
+private:
+    RcppParallel::RVector<int> input_i;
+    RcppParallel::RVector<int> input_p;
+    RcppParallel::RVector<int> values;
+    RcppParallel::RVector<int> output_p;
+    RcppParallel::RVector<int> output_i;
+    RcppParallel::RVector<double> output_x;
+
+public:
+    CompactSparseWorker(const Rcpp::IntegerVector& i, const Rcpp::IntegerVector& p, const Rcpp::IntegerVector& values,
+                        const Rcpp::IntegerVector& out_p, Rcpp::IntegerVector& out_i, Rcpp::NumericVector& out_x);
+
+    void operator()(std::size_t begin, std::size_t end) override;
+};
+
 
 #endif // DOWNSAMPLEWORKER_H
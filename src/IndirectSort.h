@@ -2,6 +2,7 @@
 #define TGLKMEANS_INDIRECTSORT_H
 
 
+#include <algorithm>
 #include <vector>
 
 template<class T>
@@ -19,5 +20,17 @@ public:
 	}
 };
 
+// Sets order to the indices of vals sorted by value, ties by index (the order a stable sort of
+// 0..n-1 gives). order is resized to vals.size().
+template<class T>
+void indirect_sort(std::vector<int> &order, const std::vector<T> &vals) {
+	order.resize(vals.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&vals](int i1, int i2) {
+		return vals[i1] < vals[i2] || (!(vals[i2] < vals[i1]) && i1 < i2);
+	});
+}
 
 #endif // TGLKMEANS_INDIRECTSORT_H
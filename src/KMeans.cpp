@@ -3,135 +3,245 @@
 //
 
 #include <algorithm>
+#include <memory>
 #include "KMeans.h"
 #include "UpdateMinDistanceWorker.h"
 #include "AddCoreWorker.h"
 #include "ReassignWorker.h"
+#include "AssignWorker.h"
+#include "UpdateCentersWorker.h"
+#include "KMeansCenterIndex.h"
+#include "KMeansCenterMeanEuclid.h"
+#include "Parallel.h"
+#include "RankSelect.h"
 #include "Random.h"
 #include <Rcpp.h>
 
 using namespace std;
 
-KMeans::KMeans(const vector<vector<float>> &data, int k, vector<KMeansCenterBase *> &centers, const bool& use_cpp_random) :
+KMeans::KMeans(const KMeansData &data, int k, vector<KMeansCenterBase *> &centers, const bool& use_cpp_random) :
         m_k(k),
         m_centers(centers),
         m_assignment(data.size(), -1),
+        m_prune_seeding(!centers.empty() && dynamic_cast<KMeansCenterMeanEuclid *>(centers[0]) != nullptr),
         m_data(data),
-        m_use_cpp_random(use_cpp_random) {
+        m_use_cpp_random(use_cpp_random),
+        m_use_index(KMeansCenterIndex::applicable(data, centers)),
+        m_nested(false),
+        m_null_log(nullptr),
+        m_token(nullptr),
+        m_margins(nullptr),
+        m_converged(false) {
 }
 
-float KMeans::random_fraction() {
-    if (m_use_cpp_random){
+KMeans::KMeans(const KMeansData &data, int k, vector<KMeansCenterBase *> &centers, const bool& use_cpp_random, const vector<float> &weights) :
+        KMeans(data, k, centers, use_cpp_random) {
+    m_weights = weights;
+}
+
+void KMeans::set_margins(AssignmentMargins *margins) {
+    m_margins = margins;
+    if (m_margins != nullptr) {
+        m_margins->resize(m_data.size());
+    }
+}
+
+void KMeans::set_nested(unsigned int seed) {
+    // Use a private random stream, no logging and no interrupt checks
+    m_nested = true;
+    m_rng.seed(seed);
+}
+
+double KMeans::random_fraction(bool wide) {
+    if (m_nested){
+        if (wide) {
+            return std::uniform_real_distribution<double>(0, 1)(m_rng);
+        }
+        return std::uniform_real_distribution<float>(0, 1)(m_rng);
+    } else if (m_use_cpp_random){
         return Random::fraction();
     } else {
         return R::runif(0, 1);
     }
 }
 
-bool KMeans::is_valid_seed(int index) {
+size_t KMeans::random_index(size_t n) {
+    return fraction_to_index(random_fraction(n >= FLOAT_FRACTION_ROWS), n);
+}
+
+ostream &KMeans::log() {
+    if (m_nested) {
+        return m_null_log;
+    }
+    return Rcpp::Rcout;
+}
+
+void KMeans::check_interrupt() {
+    if (m_nested) {
+        return;
+    }
+    if (m_token != nullptr) {
+        m_token->check_interrupt();
+    } else {
+        Rcpp::checkUserInterrupt();
+    }
+}
+
+void KMeans::run_phase(const std::function<void()> &phase) {
+    if (m_token != nullptr && !m_nested) {
+        run_cancellable(*m_token, phase);
+        check_interrupt();
+    } else {
+        phase();
+    }
+}
+
+bool KMeans::is_valid_seed(size_t index) {
     // Check if a data point has at least one non-missing value
-    for (const auto& val : m_data[index]) {
+    if (m_data.complete(index)) {
+        return m_data.dim() > 0;
+    }
+    vector<float> buf;
+    for (const auto& val : m_data.row(index, buf)) {
         if (val != REAL_MAX) return true;
     }
     return false;
 }
 
 void KMeans::cluster(int max_iter, float min_assign_change_fraction) {
-    Rcpp::Rcout << "will generate seeds" << endl;
+    log() << "will generate seeds" << endl;
     generate_seeds();
 
     int iter = 0;
     m_changes = 0;
 
-    Rcpp::Rcout << "reassign after init" << endl;
+    log() << "reassign after init" << endl;
     reassign();
 
-    while (iter < max_iter && m_changes / m_assignment.size() > min_assign_change_fraction) {
-        Rcpp::Rcout << "iter " << iter << endl;
+    while (iter < max_iter && m_changes / m_assignment.size() > min_assign_change_fraction && !cancelled()) {
+        log() << "iter " << iter << endl;
         m_changes = 0;
         update_centers();
         reassign();
         iter++;
-        Rcpp::Rcout << "iter " << iter << " changed " << m_changes << endl;
-        Rcpp::checkUserInterrupt();
+        log() << "iter " << iter << " changed " << m_changes << endl;
+        check_interrupt();
+    }
+
+    m_converged = !cancelled() && m_changes / m_assignment.size() <= min_assign_change_fraction;
+    if (cancelled()) {
+        log() << "time limit reached after " << iter << " iterations" << endl;
     }
 }
 
+void KMeans::refine(const vector<int> &assignment, int max_iter, float min_assign_change_fraction) {
+    // Start from the centers of the given assignment and run Lloyd iterations
+    vector<float> buf;
+    m_assignment = assignment;
+    for (int i = 0; i < m_k; i++) {
+        m_centers[i]->reset_votes();
+    }
+    for (size_t i = 0; i < m_data.size(); i++) {
+        m_centers[m_assignment[i]]->vote(m_data.row(i, buf), weight(i), m_data.na_mask(i));
+    }
+    update_centers();
+
+    int iter = 0;
+    m_changes = m_assignment.size();
+    while (iter < max_iter && m_changes / m_assignment.size() > min_assign_change_fraction && !cancelled()) {
+        log() << "refine iter " << iter << endl;
+        m_changes = 0;
+        reassign();
+        update_centers();
+        iter++;
+        log() << "refine iter " << iter << " changed " << m_changes << endl;
+        check_interrupt();
+    }
+    m_converged = !cancelled() && m_changes / m_assignment.size() <= min_assign_change_fraction;
+}
+
 void KMeans::generate_seeds() {
-    Rcpp::Rcout << "generating seeds" << endl;
+    log() << "generating seeds" << endl;
 
     // Initialize m_min_dist ONCE - aligned with data indices
-    m_min_dist.resize(m_data.size());
-    for (size_t i = 0; i < m_data.size(); ++i) {
-        m_min_dist[i] = std::make_pair(REAL_MAX, (int)i);
+    m_min_dist.assign(m_data.size(), REAL_MAX);
+    if (m_prune_seeding) {
+        m_min_center.assign(m_data.size(), -1);
     }
 
+    // Orders rows by distance, ties by row (the order of sorting (distance, row) pairs)
+    auto by_min_dist = [&](size_t a, size_t b) {
+        return m_min_dist[a] < m_min_dist[b] || (m_min_dist[a] == m_min_dist[b] && a < b);
+    };
+
     for (int i = 0; i < m_k; i++) {
-        Rcpp::Rcout << "at seed " << i << endl;
+        if (i > 0 && cancelled()) {
+            // Out of time: the remaining centers stay empty, and no row will be assigned to them
+            log() << "time limit reached after " << i << " seeds" << endl;
+            for (int j = i; j < m_k; j++) {
+                m_centers[j]->reset_votes();
+                m_centers[j]->init_to_votes();
+            }
+            break;
+        }
+        log() << "at seed " << i << endl;
 
-        int seed_i = -1;
+        size_t seed_i = 0;
         if (i == 0) {
             // First seed: random selection, skipping all-NA points
-            int attempts = 0;
+            size_t attempts = 0;
             do {
-                seed_i = random_fraction() * m_data.size();
-                if (seed_i >= (int)m_data.size()) seed_i = m_data.size() - 1;
+                seed_i = random_index(m_data.size());
+                if (seed_i >= m_data.size()) seed_i = m_data.size() - 1;
                 attempts++;
-            } while (!is_valid_seed(seed_i) && attempts < (int)m_data.size());
+            } while (!is_valid_seed(seed_i) && attempts < m_data.size());
             if (!is_valid_seed(seed_i)) {
                 throw std::logic_error("No valid seed point found - all data points have missing values");
             }
         } else {
-            // Create sorted copy for seed selection (m_min_dist stays index-aligned)
-            vector<pair<float, int>> valid_dist;
-            valid_dist.reserve(m_min_dist.size());
-
-            for (const auto& p : m_min_dist) {
-                // Filter: unassigned. Keep REAL_MAX distances so rows with no overlap remain candidates.
-                if (p.first != -REAL_MAX) {
-                    valid_dist.push_back(p);
-                }
-            }
+            // Candidates are the unassigned rows, which follow the assigned ones (-REAL_MAX) in the
+            // order of m_min_dist. REAL_MAX distances are kept so rows with no overlap remain candidates.
+            size_t n_assigned = count_key(m_min_dist, -REAL_MAX);
+            size_t n_valid = m_min_dist.size() - n_assigned;
 
-            if (valid_dist.empty()) {
+            if (n_valid == 0) {
                 throw std::logic_error("No valid candidates for seed selection - data may have too many missing values");
             }
-
-            sort(valid_dist.begin(), valid_dist.end());
-            Rcpp::Rcout << "done update min distance" << endl;
+            log() << "done update min distance" << endl;
 
             // Select from 1/k of the data which is in the 1-1/2k quantile of the min distance
             // Note: Uses integer division (1 / (2 * m_k)) to match original behavior
-            int to_i = int(valid_dist.size() * (1 - 1 / (2 * m_k)));
-            int from_i = to_i - int(m_data.size() / m_k);
-            Rcpp::Rcout << "seed range " << from_i << " " << to_i << endl;
+            int64_t to_i = int64_t(n_valid * (1 - 1 / (2 * m_k)));
+            int64_t from_i = to_i - int64_t(m_data.size() / m_k);
+            log() << "seed range " << from_i << " " << to_i << endl;
             if (from_i < 0) {
                 from_i = 0;
             }
 
             // Try to find a valid seed (skip all-NA points)
-            int attempts = 0;
+            int64_t attempts = 0;
             do {
-                int rnd_i = from_i + int(random_fraction() * (to_i - from_i));
-                if (rnd_i >= (int)valid_dist.size()) rnd_i = valid_dist.size() - 1;
-                seed_i = valid_dist[rnd_i].second;
+                size_t rnd_i = from_i + random_index(to_i - from_i);
+                if (rnd_i >= n_valid) rnd_i = n_valid - 1;
+                // The candidate of rank rnd_i, without sorting the candidates
+                seed_i = select_rank(m_min_dist, n_assigned + rnd_i);
                 attempts++;
             } while (!is_valid_seed(seed_i) && attempts < (to_i - from_i + 1));
 
-            // If no valid seed in quantile range, scan entire valid_dist
+            // If no valid seed in quantile range, take the first valid candidate
             if (!is_valid_seed(seed_i)) {
-                seed_i = -1;
-                for (const auto& p : valid_dist) {
-                    if (is_valid_seed(p.second)) {
-                        seed_i = p.second;
-                        break;
+                bool found = false;
+                for (size_t j = 0; j < m_min_dist.size(); j++) {
+                    if (m_min_dist[j] != -REAL_MAX && (!found || by_min_dist(j, seed_i)) && is_valid_seed(j)) {
+                        seed_i = j;
+                        found = true;
                     }
                 }
-                if (seed_i == -1) {
+                if (!found) {
                     throw std::logic_error("No valid seed candidates - too many all-NA rows in data");
                 }
             }
-            Rcpp::Rcout << "picked up " << seed_i << endl;
+            log() << "picked up " << seed_i << endl;
         }
 
         // Add core (parallel)
@@ -140,7 +250,7 @@ void KMeans::generate_seeds() {
         // Update min distances for NEXT iteration (incremental - only compares to center i)
         update_min_distance(i);
 
-        Rcpp::checkUserInterrupt();
+        check_interrupt();
     }
 }
 
@@ -148,65 +258,99 @@ void KMeans::generate_seeds() {
 void KMeans::update_min_distance(int center_idx) {
     // Note: m_min_dist must be pre-sized and initialized before first call (in generate_seeds)
     // This performs an INCREMENTAL update - only comparing to the new center
-    UpdateMinDistanceWorker worker(m_data, m_centers[center_idx], m_min_dist, m_assignment);
-    RcppParallel::parallelFor(0, m_data.size(), worker);
+    UpdateMinDistanceWorker worker(m_data, m_centers[center_idx], m_min_dist, m_assignment, m_token);
+
+    // Distances of the earlier centers to the new one (-1 where a center has missing coordinates),
+    // so rows whose closest center is far from the new one are skipped
+    vector<float> center_dist;
+    if (m_prune_seeding) {
+        center_dist.assign(center_idx, -1);
+        vector<float> new_coords = m_centers[center_idx]->report_vector();
+        if (find(new_coords.begin(), new_coords.end(), REAL_MAX) == new_coords.end()) {
+            for (int j = 0; j < center_idx; j++) {
+                vector<float> coords = m_centers[j]->report_vector();
+                if (find(coords.begin(), coords.end(), REAL_MAX) == coords.end()) {
+                    center_dist[j] = m_centers[center_idx]->dist(coords);
+                }
+            }
+        }
+        worker.set_pruning(&m_min_center, center_idx, &center_dist);
+    }
+    run_phase([&]() { Parallel::parallel_for(0, m_data.size(), worker, row_grain(1), &m_min_dist_affinity); });
     // NOTE: Do NOT sort here - sorting happens in generate_seeds when needed
 }
 
 
-void KMeans::add_new_core(int seed_i, int center_i) {
-    Rcpp::Rcout << "add new core from " << seed_i << " to " << center_i << endl;
+void KMeans::add_new_core(size_t seed_i, int center_i) {
+    log() << "add new core from " << seed_i << " to " << center_i << endl;
 
     // Initialize center with seed
+    vector<float> buf;
     m_centers[center_i]->reset_votes();
-    m_centers[center_i]->vote(m_data[seed_i], 1);
+    m_centers[center_i]->vote(m_data.row(seed_i, buf), weight(seed_i), m_data.na_mask(seed_i));
     m_centers[center_i]->init_to_votes();
 
     // Parallel distance calculation
     m_core_dist.resize(m_data.size());
-    AddCoreWorker worker(m_data, m_centers[center_i], m_assignment, m_core_dist);
-    RcppParallel::parallelFor(0, m_data.size(), worker);
+    // The first core is always completed, so that a stopped run still has a cluster
+    AddCoreWorker worker(m_data, m_centers[center_i], m_assignment, m_core_dist, center_i > 0 ? m_token : nullptr);
+    run_phase([&]() { Parallel::parallel_for(0, m_data.size(), worker, row_grain(1), &m_core_affinity); });
+    if (center_i > 0 && cancelled()) {
+        // The distances are incomplete, the seed is dropped
+        m_centers[center_i]->reset_votes();
+        m_centers[center_i]->init_to_votes();
+        return;
+    }
 
-    // Use partial_sort for O(N) instead of O(N log N)
-    int to_add_n = int(m_data.size() / (2 * m_k));
+    size_t to_add_n = m_data.size() / (2 * m_k);
     if (to_add_n < 1) {
         to_add_n = 1;  // Ensure at least 1 point per cluster during seeding
     }
 
-    std::partial_sort(m_core_dist.begin(),
-                      m_core_dist.begin() + to_add_n,
-                      m_core_dist.end());
+    // The closest rows by distance, ties by row (assigned rows have REAL_MAX and are not selected)
+    vector<size_t> &closest = m_core_rows;
+    select_smallest(m_core_dist, to_add_n, closest);
 
     // Assign closest points
-    int count = 0;
     m_centers[center_i]->reset_votes();
-    for (auto i = m_core_dist.begin(); count < to_add_n && i != m_core_dist.end(); i++) {
-        if (i->first == REAL_MAX) break;  // Hit assigned points
-        m_centers[center_i]->vote(m_data[i->second], 1);
-        m_assignment[i->second] = center_i;
-        count++;
+    for (size_t row : closest) {
+        m_centers[center_i]->vote(m_data.row(row, buf), weight(row), m_data.na_mask(row));
+        m_assignment[row] = center_i;
     }
     m_centers[center_i]->init_to_votes();
 }
 
 void KMeans::update_centers() {
-    for (int i = 0; i < m_k; i++) {
-        m_centers[i]->init_to_votes();
-        m_centers[i]->reset_votes();
-        Rcpp::checkUserInterrupt();
-    }
+    UpdateCentersWorker worker(m_centers);
+    // Updating a center costs about as much as a distance to it
+    Parallel::parallel_for(0, m_k, worker, Parallel::grain(m_k, m_centers[0]->dist_cost()));
+    check_interrupt();
 }
 
 void KMeans::reassign() {
+    // The index is rebuilt over the centers of the current iteration
+    unique_ptr<KMeansCenterIndex> index;
+    if (m_use_index) {
+        index = make_unique<KMeansCenterIndex>(m_centers, m_data.dim());
+    }
+
     // Initialize the ReassignWorker with data, centers, and assignments
-    ReassignWorker worker(m_data, m_centers, m_assignment);
-    
-    // Use parallelReduce instead of parallelFor to properly merge votes across threads.
-    // parallelFor copies the worker for each chunk but never merges results back,
-    // which causes votes to be lost. parallelReduce calls join() to merge results.
-    RcppParallel::parallelReduce(0, m_data.size(), worker);
-
-    // Apply accumulated votes to the centers
+    ReassignWorker worker(m_data, m_centers, m_assignment, m_weights, index.get(), m_token, m_margins);
+
+    // A k-d tree query computes the distances to a few leaves of centers
+    size_t grain = row_grain(index ? min(m_k, 32) : m_k);
+
+    // parallelReduce merges the per-chunk change counts via join()
+    run_phase([&]() { Parallel::parallel_reduce(0, m_data.size(), worker, grain, &m_reassign_affinity); });
+
+    if (cancelled() && find(m_assignment.begin(), m_assignment.end(), -1) != m_assignment.end()) {
+        // Stopped before every row had a center (first reassign): finish without the token,
+        // rows which were already reassigned keep their center
+        ReassignWorker rest(m_data, m_centers, m_assignment, m_weights, index.get(), nullptr, m_margins);
+        Parallel::parallel_reduce(0, m_data.size(), rest, grain);
+    }
+
+    // Vote the new assignment to the centers
     worker.apply_votes();
 
     // Update the number of changes based on the worker's results
@@ -231,10 +375,11 @@ void KMeans::report_assignment(vector<string> &row_names, ostream &assign_tab) {
     assign_tab << "id\tclust";
     m_centers[0]->report_meta_data_header(assign_tab);
     assign_tab << "\n";
+    vector<float> buf;
     for (size_t i = 0; i < m_data.size(); i++) {
         assign_tab << row_names[i] << "\t" << m_assignment[i];
 
-        m_centers[m_assignment[i]]->report_meta_data(assign_tab, m_data[i]);
+        m_centers[m_assignment[i]]->report_meta_data(assign_tab, m_data.row(i, buf));
 
         assign_tab << "\n";
     }
@@ -243,3 +388,50 @@ void KMeans::report_assignment(vector<string> &row_names, ostream &assign_tab) {
 vector<int> KMeans::report_assignment_to_vector() {
     return std::vector<int>(m_assignment);
 }
+
+double KMeans::objective() {
+    vector<float> buf;
+    double total = 0;
+    for (size_t i = 0; i < m_data.size(); i++) {
+        int clust = m_assignment[i];
+        if (clust < 0) {
+            continue;
+        }
+        float dist = m_centers[clust]->dist(m_data.row(i, buf), m_data.na_mask(i));
+        if (dist != REAL_MAX) {
+            total += m_centers[clust]->cost(dist) * weight(i);
+        }
+    }
+    return total;
+}
+
+vector<int> KMeans::assign(const KMeansData &data, vector<KMeansCenterBase *> &centers, AssignmentMargins *margins,
+                           const CancellationToken *token) {
+    // Label rows (which may not be the clustered ones) by their closest center
+    vector<int> assignment(data.size(), -1);
+    vector<float> dist(data.size(), REAL_MAX);
+    unique_ptr<KMeansCenterIndex> index;
+    if (KMeansCenterIndex::applicable(data, centers)) {
+        index = make_unique<KMeansCenterIndex>(centers, data.dim());
+    }
+    if (margins != nullptr) {
+        margins->resize(data.size());
+    }
+    AssignWorker worker(data, centers, assignment, dist, index.get(), margins, false, token);
+    double dists_per_row = index ? min(centers.size(), (size_t) 32) : centers.size();
+    Parallel::parallel_for(0, data.size(), worker, Parallel::grain(data.size(), dists_per_row * centers[0]->dist_cost()));
+    return assignment;
+}
+
+void KMeans::assignment_margins(const KMeansData &data, vector<KMeansCenterBase *> &centers, vector<int> &assignment,
+                                AssignmentMargins &margins) {
+    vector<float> dist(data.size(), REAL_MAX);
+    unique_ptr<KMeansCenterIndex> index;
+    if (KMeansCenterIndex::applicable(data, centers)) {
+        index = make_unique<KMeansCenterIndex>(centers, data.dim());
+    }
+    margins.resize(data.size());
+    AssignWorker worker(data, centers, assignment, dist, index.get(), &margins, true);
+    double dists_per_row = index ? min(centers.size(), (size_t) 32) : centers.size();
+    Parallel::parallel_for(0, data.size(), worker, Parallel::grain(data.size(), dists_per_row * centers[0]->dist_cost()));
+}
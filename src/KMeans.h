@@ -6,6 +6,12 @@
 #define TGLKMEANS_KMEANS_H
 
 #include "KMeansCenterBase.h"
+#include "KMeansData.h"
+#include "Cancellation.h"
+#include "AssignmentMargins.h"
+#include "Parallel.h"
+#include <functional>
+#include <random>
 
 class KMeans {
 protected:
@@ -16,24 +22,74 @@ protected:
 
     std::vector<int> m_assignment;
 
-    std::vector<std::pair<float, int>> m_min_dist;
-    std::vector<std::pair<float, int>> m_core_dist;
+    // Seeding buffers, indexed by row: the distance to the closest seed (-REAL_MAX once the row is assigned)
+    // and the distance to the newest core (REAL_MAX for assigned rows)
+    std::vector<float> m_min_dist;
+    std::vector<float> m_core_dist;
 
-    const std::vector<std::vector<float>> &m_data;
+    // Center of each row's m_min_dist (-1 if none), for the triangle inequality pruning of euclid seeding
+    std::vector<int> m_min_center;
+    bool m_prune_seeding;
+
+    // Rows added to the newest core, reused across seeds
+    std::vector<size_t> m_core_rows;
+
+    const KMeansData &m_data;
+
+    // Per-row weights (empty means all rows weigh 1)
+    std::vector<float> m_weights;
 
     float m_changes;
 
     bool m_use_cpp_random;
 
+    // Reassign through a k-d tree over the centers (low dimensional euclidean data without NAs)
+    bool m_use_index;
+
+    // Nested instances run inside worker threads and must not touch the R API
+    bool m_nested;
+    std::mt19937 m_rng;
+    std::ostream m_null_log;
+
+    // Interrupts and time limit of the run (nullptr means only the R interrupts between phases)
+    CancellationToken *m_token;
+
+    // Margins recorded by every reassign, so that they hold those of the final one (nullptr means not recorded)
+    AssignmentMargins *m_margins;
+
+    // The last iteration changed at most min_delta of the assignments
+    bool m_converged;
+
+    // Thread affinity of the loops over the rows, which are repeated for every seed / iteration
+    ParallelAffinity m_min_dist_affinity;
+    ParallelAffinity m_core_affinity;
+    ParallelAffinity m_reassign_affinity;
+
 public:
 
-    KMeans(const std::vector<std::vector<float>> &data, int k, std::vector<KMeansCenterBase *> &centers, const bool& use_cpp_random);
+    KMeans(const KMeansData &data, int k, std::vector<KMeansCenterBase *> &centers, const bool& use_cpp_random);
+
+    KMeans(const KMeansData &data, int k, std::vector<KMeansCenterBase *> &centers, const bool& use_cpp_random, const std::vector<float> &weights);
 
     void cluster(int max_iter, float min_delta_assign);
 
+    void refine(const std::vector<int> &assignment, int max_iter, float min_delta_assign);
+
+    void set_nested(unsigned int seed);
+
+    void set_cancellation(CancellationToken *token) { m_token = token; }
+
+    // The margins match the reported centers after cluster(), but not after refine(), which updates the
+    // centers after its last reassign
+    void set_margins(AssignmentMargins *margins);
+
+    bool cancelled() const { return m_token != nullptr && m_token->cancelled(); }
+
+    bool converged() const { return m_converged; }
+
     void update_min_distance(int center_idx);
 
-    void add_new_core(int seed_i, int center_i);
+    void add_new_core(size_t seed_i, int center_i);
 
     void generate_seeds();
 
@@ -49,9 +105,37 @@ public:
 
     std::vector<int> report_assignment_to_vector();
 
-    float random_fraction();
+    // Weighted sum of the cost of the rows relative to their centers
+    double objective();
+
+    // Labels every row by its closest center. Stops early (leaving rows unlabeled) if the token is interrupted.
+    static std::vector<int> assign(const KMeansData &data, std::vector<KMeansCenterBase *> &centers,
+                                   AssignmentMargins *margins = nullptr, const CancellationToken *token = nullptr);
+
+    // Margins of a given assignment: the distance of every row to its center and to the closest other center
+    static void assignment_margins(const KMeansData &data, std::vector<KMeansCenterBase *> &centers,
+                                   std::vector<int> &assignment, AssignmentMargins &margins);
+
+    // wide draws all 53 bits of a double in nested runs too (the other sources always draw doubles)
+    double random_fraction(bool wide = false);
+
+    // A random row index in [0, n] (n when the fraction rounds up), from a float fraction below FLOAT_FRACTION_ROWS
+    // (the seeds of smaller inputs are unchanged) and from a double fraction above it, so that every row can be drawn
+    size_t random_index(size_t n);
+
+    std::ostream &log();
+
+    void check_interrupt();
+
+    // Runs a parallel phase, polling the token on the R thread while it runs
+    void run_phase(const std::function<void()> &phase);
+
+    bool is_valid_seed(size_t index);
+
+    // Chunk size of a loop over the rows that computes dists_per_row distances per row
+    size_t row_grain(double dists_per_row) const { return Parallel::grain(m_data.size(), dists_per_row * m_centers[0]->dist_cost()); }
 
-    bool is_valid_seed(int index);
+    float weight(size_t index) const { return m_weights.empty() ? 1 : m_weights[index]; }
 };
 
 
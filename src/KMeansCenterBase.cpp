@@ -15,3 +15,8 @@ void KMeansCenterBase::report_meta_data(ostream &out, const vector<float> &v)
 {
     //do nothing by default
 }
+
+float KMeansCenterBase::cost(float dist) const
+{
+    return dist * dist;
+}
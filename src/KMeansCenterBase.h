@@ -9,8 +9,14 @@
 #include <iostream>
 #include <string>
 #include <limits>
+#include <cstdint>
 constexpr float REAL_MAX = std::numeric_limits<float>::max();
 
+// Whether dimension d is set in an NA bitmap (see KMeansData::na_mask)
+inline bool na_bit(const uint64_t *na, size_t d) {
+    return (na[d >> 6] >> (d & 63)) & 1;
+}
+
 class KMeansCenterBase {
 public:
     virtual ~KMeansCenterBase() = default;
@@ -19,10 +25,27 @@ public:
 
     virtual void vote(const std::vector<float> &v, float wgt) = 0;
 
+    // Same as above for a row with a known NA layout: v_na is its NA bitmap, or nullptr if it is complete.
+    // Centers override these with paths that do not test every value for NA.
+    virtual float dist(const std::vector<float> &v, const uint64_t *v_na) const { return dist(v); }
+
+    virtual void vote(const std::vector<float> &v, float wgt, const uint64_t *v_na) { vote(v, wgt); }
+
+    // Votes only dimensions [dim_begin, dim_end) of v, so that the votes of a center can be split between threads
+    virtual void vote(const std::vector<float> &v, float wgt, const uint64_t *v_na, size_t dim_begin, size_t dim_end) = 0;
+
     virtual void reset_votes() = 0;
 
     virtual void init_to_votes() = 0;
 
+    virtual float cost(float dist) const; //squared-distance analogue of dist, >= 0
+
+    // Distance analogue of dist, >= 0 (used by the silhouette and Davies-Bouldin indices)
+    virtual float dissimilarity(float dist) const { return dist; }
+
+    // Rough number of arithmetic operations of a dist() call, used to size the chunks of parallel loops
+    virtual double dist_cost() const = 0;
+
     virtual void report_meta_data_header(std::ostream &out);
 
     virtual void report_meta_data(std::ostream &out, const std::vector<float> &v);
@@ -0,0 +1,36 @@
+//
+// Creation of centers by metric name
+//
+
+#include <stdexcept>
+#include "KMeansCenterFactory.h"
+#include "KMeansCenterMeanEuclid.h"
+#include "KMeansCenterMeanPearson.h"
+#include "KMeansCenterMeanSpearman.h"
+
+using namespace std;
+
+void create_centers(const string &metric, int k, int dim, vector<unique_ptr<KMeansCenterBase>> &owned_centers, vector<KMeansCenterBase *> &centers) {
+    owned_centers.resize(k);
+
+    if (metric == "euclid") {
+        for (int i = 0; i < k; i++) {
+            owned_centers[i] = make_unique<KMeansCenterMeanEuclid>(dim);
+        }
+    } else if (metric == "pearson") {
+        for (int i = 0; i < k; i++) {
+            owned_centers[i] = make_unique<KMeansCenterMeanPearson>(dim);
+        }
+    } else if (metric == "spearman") {
+        for (int i = 0; i < k; i++) {
+            owned_centers[i] = make_unique<KMeansCenterMeanSpearman>(dim);
+        }
+    } else {
+        throw std::logic_error("possible metrics are 'euclid', 'pearson' and 'spearman'");
+    }
+
+    centers.resize(k);
+    for (int i = 0; i < k; i++) {
+        centers[i] = owned_centers[i].get();
+    }
+}
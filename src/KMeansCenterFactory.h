@@ -0,0 +1,17 @@
+//
+// Creation of centers by metric name
+//
+
+#ifndef TGLKMEANS_KMEANSCENTERFACTORY_H
+#define TGLKMEANS_KMEANSCENTERFACTORY_H
+
+#include <memory>
+#include "KMeansCenterBase.h"
+
+// Creates k centers of the given metric ('euclid', 'pearson' or 'spearman'). The centers are
+// owned by owned_centers, and centers holds the raw pointers which are passed to KMeans.
+void create_centers(const std::string &metric, int k, int dim,
+                    std::vector<std::unique_ptr<KMeansCenterBase>> &owned_centers,
+                    std::vector<KMeansCenterBase *> &centers);
+
+#endif //TGLKMEANS_KMEANSCENTERFACTORY_H
@@ -0,0 +1,152 @@
+//
+// k-d tree over the centers for nearest center queries on low dimensional data
+//
+
+#include <algorithm>
+#include <limits>
+#include "KMeansCenterIndex.h"
+#include "KMeansCenterMeanEuclid.h"
+
+using namespace std;
+
+// Relative slack on the pruning bound, covering the rounding of dist() (sqrt(dist2) / dim in floats)
+static const double BOUND_SLACK = 1e-4;
+
+bool KMeansCenterIndex::applicable(const KMeansData &data, const vector<KMeansCenterBase *> &centers) {
+    if (centers.size() < MIN_CENTERS || data.dim() > MAX_DIM || data.dim() == 0) {
+        return false;
+    }
+    if (dynamic_cast<KMeansCenterMeanEuclid *>(centers[0]) == nullptr) {
+        return false;
+    }
+    return !data.has_na();
+}
+
+KMeansCenterIndex::KMeansCenterIndex(const vector<KMeansCenterBase *> &centers, size_t dim) :
+        m_centers(centers),
+        m_dim(dim) {
+    m_coords.reserve(centers.size());
+    for (size_t i = 0; i < centers.size(); i++) {
+        m_coords.push_back(centers[i]->report_vector());
+        size_t missing = count(m_coords[i].begin(), m_coords[i].end(), REAL_MAX);
+        if (missing == m_dim) {
+            // Empty centers are never the closest (their distance is REAL_MAX)
+            continue;
+        } else if (missing > 0) {
+            m_irregular.push_back(i);
+        } else {
+            m_order.push_back(i);
+        }
+    }
+    if (!m_order.empty()) {
+        build(0, m_order.size());
+    }
+}
+
+int KMeansCenterIndex::build(int begin, int end) {
+    int node_i = m_nodes.size();
+    m_nodes.push_back(Node{-1, 0, -1, -1, begin, end});
+    if (end - begin <= LEAF_SIZE) {
+        return node_i;
+    }
+
+    // Split the widest dimension at the median
+    int split_dim = 0;
+    float widest = -1;
+    for (size_t d = 0; d < m_dim; d++) {
+        float lo = REAL_MAX;
+        float hi = -REAL_MAX;
+        for (int i = begin; i < end; i++) {
+            lo = min(lo, m_coords[m_order[i]][d]);
+            hi = max(hi, m_coords[m_order[i]][d]);
+        }
+        if (hi - lo > widest) {
+            widest = hi - lo;
+            split_dim = d;
+        }
+    }
+    if (widest <= 0) {
+        return node_i;
+    }
+
+    int mid = begin + (end - begin) / 2;
+    nth_element(m_order.begin() + begin, m_order.begin() + mid, m_order.begin() + end, [&](int a, int b) {
+        return m_coords[a][split_dim] < m_coords[b][split_dim];
+    });
+
+    // Taken before the recursion, which reorders the ranges
+    float split = m_coords[m_order[mid]][split_dim];
+    int left = build(begin, mid);
+    int right = build(mid, end);
+    Node &node = m_nodes[node_i];
+    node.split_dim = split_dim;
+    node.split = split;
+    node.left = left;
+    node.right = right;
+    return node_i;
+}
+
+int KMeansCenterIndex::nearest(const vector<float> &x, const uint64_t *x_na, float &best_dist) const {
+    Query q{-1, REAL_MAX, false, -1, REAL_MAX, numeric_limits<double>::infinity()};
+    query(x, x_na, q);
+    best_dist = q.best_dist;
+    return q.best;
+}
+
+int KMeansCenterIndex::nearest(const vector<float> &x, const uint64_t *x_na, float &best_dist, int &second, float &second_dist) const {
+    Query q{-1, REAL_MAX, true, -1, REAL_MAX, numeric_limits<double>::infinity()};
+    query(x, x_na, q);
+    best_dist = q.best_dist;
+    second = q.second;
+    second_dist = q.second_dist;
+    return q.best;
+}
+
+void KMeansCenterIndex::query(const vector<float> &x, const uint64_t *x_na, Query &q) const {
+    for (int center_i : m_irregular) {
+        consider(center_i, x, x_na, q);
+    }
+    if (!m_nodes.empty()) {
+        search(0, x, x_na, q);
+    }
+}
+
+void KMeansCenterIndex::consider(int center_i, const vector<float> &x, const uint64_t *x_na, Query &q) const {
+    float dist = m_centers[center_i]->dist(x, x_na);
+    if (dist < q.best_dist || (dist == q.best_dist && center_i < q.best)) {
+        if (q.track_second) {
+            q.second = q.best;
+            q.second_dist = q.best_dist;
+        }
+        q.best_dist = dist;
+        q.best = center_i;
+    } else if (q.track_second && (dist < q.second_dist || (dist == q.second_dist && center_i < q.second))) {
+        q.second_dist = dist;
+        q.second = center_i;
+    } else {
+        return;
+    }
+    // Centers farther than the last one kept cannot change the result
+    float bound_dist = q.track_second ? q.second_dist : q.best_dist;
+    if (bound_dist < REAL_MAX) {
+        // dist() is sqrt(squared distance) / dim, the bound is on the squared distance
+        double bound = (double) bound_dist * m_dim;
+        q.bound2 = bound * bound * (1 + BOUND_SLACK);
+    }
+}
+
+void KMeansCenterIndex::search(int node_i, const vector<float> &x, const uint64_t *x_na, Query &q) const {
+    const Node &node = m_nodes[node_i];
+    if (node.split_dim < 0) {
+        for (int i = node.begin; i < node.end; i++) {
+            consider(m_order[i], x, x_na, q);
+        }
+        return;
+    }
+
+    double diff = (double) x[node.split_dim] - node.split;
+    search(diff < 0 ? node.left : node.right, x, x_na, q);
+    if (diff * diff <= q.bound2) {
+        search(diff < 0 ? node.right : node.left, x, x_na, q);
+    }
+}
@@ -0,0 +1,84 @@
+//
+// k-d tree over the centers for nearest center queries on low dimensional data
+//
+
+#ifndef TGLKMEANS_KMEANSCENTERINDEX_H
+#define TGLKMEANS_KMEANSCENTERINDEX_H
+
+#include <vector>
+#include "KMeansCenterBase.h"
+#include "KMeansData.h"
+
+// The tree is built over a snapshot of the center coordinates and has to be rebuilt whenever
+// the centers change. Queries return exactly the center a scan over all the centers would
+// (including the lowest index on ties), as the candidates are compared by their own dist().
+// Only valid for euclidean centers and rows without missing values.
+class KMeansCenterIndex {
+protected:
+
+    static const int LEAF_SIZE = 8;
+
+    struct Node {
+        int split_dim;  // -1 for leaves
+        float split;
+        int left;
+        int right;
+        int begin;      // range in m_order (leaves)
+        int end;
+    };
+
+    const std::vector<KMeansCenterBase *> &m_centers;
+
+    size_t m_dim;
+
+    std::vector<std::vector<float>> m_coords;
+
+    std::vector<int> m_order;
+
+    // Centers with missing coordinates (e.g. empty clusters), which are scanned on every query
+    std::vector<int> m_irregular;
+
+    std::vector<Node> m_nodes;
+
+    // State of a query: the closest center so far, the runner up when it is tracked, and the bound on the
+    // squared distance of the centers that can still replace them
+    struct Query {
+        int best;
+        float best_dist;
+        bool track_second;
+        int second;
+        float second_dist;
+        double bound2;
+    };
+
+public:
+
+    static const size_t MAX_DIM = 10;
+
+    static const size_t MIN_CENTERS = 32;
+
+    // Whether the index is correct and worth building for this data and centers
+    static bool applicable(const KMeansData &data, const std::vector<KMeansCenterBase *> &centers);
+
+    KMeansCenterIndex(const std::vector<KMeansCenterBase *> &centers, size_t dim);
+
+    // Returns the closest center to x (-1 if no center overlaps x) and its distance in best_dist. Thread safe.
+    int nearest(const std::vector<float> &x, const uint64_t *x_na, float &best_dist) const;
+
+    // Also returns the second closest center (-1 if there is none) and its distance, as a scan would
+    // (the lowest (distance, index) after the closest one). Thread safe.
+    int nearest(const std::vector<float> &x, const uint64_t *x_na, float &best_dist, int &second, float &second_dist) const;
+
+protected:
+
+    int build(int begin, int end);
+
+    void query(const std::vector<float> &x, const uint64_t *x_na, Query &q) const;
+
+    void search(int node_i, const std::vector<float> &x, const uint64_t *x_na, Query &q) const;
+
+    void consider(int center_i, const std::vector<float> &x, const uint64_t *x_na, Query &q) const;
+};
+
+
+#endif //TGLKMEANS_KMEANSCENTERINDEX_H
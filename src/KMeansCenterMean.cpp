@@ -2,6 +2,7 @@
 // Created by aviezerl on 6/5/17.
 //
 
+#include <algorithm>
 #include <limits>
 #include "KMeansCenterMean.h"
 
@@ -10,6 +11,7 @@ using namespace std;
 void KMeansCenterMean::init(vector<float> &cent) {
     m_center = cent;
     m_votes.resize(m_center.size());
+    m_complete = find(m_center.begin(), m_center.end(), REAL_MAX) == m_center.end();
 
     update_center_stats();
 }
@@ -27,6 +29,26 @@ void KMeansCenterMean::vote(const vector<float> &x, float wgt) {
     }
 }
 
+void KMeansCenterMean::vote(const vector<float> &x, float wgt, const uint64_t *x_na) {
+    vote(x, wgt, x_na, 0, m_votes.size());
+}
+
+void KMeansCenterMean::vote(const vector<float> &x, float wgt, const uint64_t *x_na, size_t dim_begin, size_t dim_end) {
+    if (x_na == nullptr) {
+        for (size_t i = dim_begin; i < dim_end; i++) {
+            m_votes[i] += x[i] * wgt;
+            m_tot_wgt[i] += wgt;
+        }
+        return;
+    }
+    for (size_t i = dim_begin; i < dim_end; i++) {
+        if (!na_bit(x_na, i)) {
+            m_votes[i] += x[i] * wgt;
+            m_tot_wgt[i] += wgt;
+        }
+    }
+}
+
 void KMeansCenterMean::reset_votes() {
     fill(m_votes.begin(), m_votes.end(), 0);
     fill(m_tot_wgt.begin(), m_tot_wgt.end(), 0);
@@ -35,11 +57,13 @@ void KMeansCenterMean::reset_votes() {
 void KMeansCenterMean::init_to_votes() {
     vector<float>::iterator v_i = m_votes.begin();
     vector<float>::iterator wgt_i = m_tot_wgt.begin();
+    m_complete = true;
     for (auto c_i = m_center.begin(); c_i != m_center.end(); c_i++) {
         if (0 != *wgt_i) {
             *c_i = *v_i / (*wgt_i);
         } else {
             *c_i = REAL_MAX;
+            m_complete = false;
         }
         v_i++;
         wgt_i++;
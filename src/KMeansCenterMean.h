@@ -17,21 +17,29 @@ protected:
     std::vector<float> m_votes;
     std::vector<float> m_tot_wgt;
 
+    // No coordinate of the center is missing (REAL_MAX)
+    bool m_complete;
+
 public:
 
     KMeansCenterMean(int dim) :
             m_center(dim, 0),
             m_votes(dim, 0),
-            m_tot_wgt(dim, 0) {}
+            m_tot_wgt(dim, 0),
+            m_complete(true) {}
 
     virtual void init(std::vector<float> &cent);
 
     virtual void vote(const std::vector<float> &v, float wgt) override;
+    virtual void vote(const std::vector<float> &v, float wgt, const uint64_t *v_na) override;
+    virtual void vote(const std::vector<float> &v, float wgt, const uint64_t *v_na, size_t dim_begin, size_t dim_end) override;
 
     virtual void reset_votes() override;  //tot = 0, votes = 0
     virtual void init_to_votes() override; //center = votes/tot
     virtual void update_center_stats();
 
+    virtual double dist_cost() const override { return 3.0 * m_center.size(); }
+
     virtual void report(std::ostream &out) override;
     virtual std::vector<float> report_vector() override;
 };
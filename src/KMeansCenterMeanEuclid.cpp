@@ -22,3 +22,25 @@ float KMeansCenterMeanEuclid::dist(const vector<float> &x) const {
     }
     return (n > 0 ? sqrt(dist2) / n : REAL_MAX);
 }
+
+float KMeansCenterMeanEuclid::dist(const vector<float> &x, const uint64_t *x_na) const {
+    if (!m_complete) {
+        return dist(x);
+    }
+    size_t dim = m_center.size();
+    float dist2 = 0;
+    if (x_na == nullptr) {
+        for (size_t i = 0; i < dim; i++) {
+            dist2 += (m_center[i] - x[i]) * (m_center[i] - x[i]);
+        }
+        return (dim > 0 ? sqrt(dist2) / dim : REAL_MAX);
+    }
+    float n = 0;
+    for (size_t i = 0; i < dim; i++) {
+        if (!na_bit(x_na, i)) {
+            dist2 += (m_center[i] - x[i]) * (m_center[i] - x[i]);
+            n++;
+        }
+    }
+    return (n > 0 ? sqrt(dist2) / n : REAL_MAX);
+}
@@ -14,6 +14,7 @@ public:
             KMeansCenterMean(dim)
     {}
     virtual float dist(const std::vector<float> &v) const override;
+    virtual float dist(const std::vector<float> &v, const uint64_t *v_na) const override;
 };
 
 
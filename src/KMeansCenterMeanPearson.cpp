@@ -36,6 +36,39 @@ float KMeansCenterMeanPearson::dist(const vector<float> &x) const
     return(-cov/sqrt(m_center_v * x_v));
 }
 
+float KMeansCenterMeanPearson::dist(const vector<float> &x, const uint64_t *x_na) const
+{
+    if(x_na != nullptr || !m_complete) {
+        return(dist(x));
+    }
+    float cov2 = 0;
+    float x_v2 = 0;
+    float x_e = 0;
+    int n = m_center.size();
+    for(int i = 0; i < n; i++) {
+        cov2 += m_center[i] * x[i];
+        x_v2 += x[i] * x[i];
+        x_e += x[i];
+    }
+    if(n == 0) {
+        return(REAL_MAX);
+    }
+    x_e /= n;
+    float cov = cov2/n - x_e * m_center_e;
+
+    float x_v = x_v2/n - x_e * x_e;
+    if(x_v == 0) {
+        return(0);
+    }
+    return(-cov/sqrt(m_center_v * x_v));
+}
+
+// 1 - r is proportional to the squared euclidean distance between standardized vectors
+float KMeansCenterMeanPearson::cost(float dist) const
+{
+    return 1 + dist;
+}
+
 void KMeansCenterMeanPearson::update_center_stats()
 {
     float c_e = 0;
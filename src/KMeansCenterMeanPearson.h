@@ -21,6 +21,15 @@ public:
 
     virtual float dist(const std::vector<float> &v) const override;
 
+    virtual float dist(const std::vector<float> &v, const uint64_t *v_na) const override;
+
+    virtual float cost(float dist) const override;
+
+    // 1 - correlation
+    virtual float dissimilarity(float dist) const override { return 1 + dist; }
+
+    virtual double dist_cost() const override { return 5.0 * m_center.size(); }
+
     virtual void update_center_stats() override;
 };
 
@@ -2,10 +2,12 @@
 // Created by aviezerl on 6/5/17.
 //
 
+#include <cmath>
 #include "KMeansCenterMeanSpearman.h"
 #include "AParamStat.h"
 #include "IndirectSort.h"
 #include "Ranking.h"
+#include "Scratch.h"
 
 using namespace std;
 
@@ -13,13 +15,8 @@ using namespace std;
 void KMeansCenterMeanSpearman::update_center_stats()
 {
     // Pre-compute sorted order and ranks for the center
-    m_center_sorted_order.clear();
-    int dim = m_center.size();
-    for (int i = 0; i < dim; i++) {
-        m_center_sorted_order.push_back(i);
-    }
-    m_center_sorted_order.sort<IndirectSort<float>>(IndirectSort<float>(m_center));
-    m_center_ranks.resize(dim);
+    indirect_sort(m_center_sorted_order, m_center);
+    m_center_ranks.resize(m_center.size());
     mid_ranking(m_center_ranks, m_center_sorted_order, m_center);
 }
 
@@ -27,9 +24,52 @@ void KMeansCenterMeanSpearman::update_center_stats()
 float KMeansCenterMeanSpearman::dist(const vector<float> &x) const
 {
     double pv;
-    // Use local rank vectors to avoid race conditions
-    vector<float> rank1(x.size());
-    vector<float> rank2(x.size());
-    return(-spearman(x, m_center, rank1, rank2, pv));
+    // Rank vectors are per thread to avoid race conditions
+    ScratchVector<float> rank1(x.size());
+    ScratchVector<float> rank2(x.size());
+    return(-spearman(x, m_center, *rank1, *rank2, pv));
 }
 
+// Complete pairs use the cached center ranks (which are the ranks spearman() computes when
+// nothing is missing) and skip the p-value
+float KMeansCenterMeanSpearman::dist(const vector<float> &x, const uint64_t *x_na) const
+{
+    if (x_na != nullptr || !m_complete) {
+        return dist(x);
+    }
+    int dim = x.size();
+    ScratchVector<int> order;
+    indirect_sort(*order, x);
+    ScratchVector<float> scratch_rank(dim);
+    vector<float> &rank = *scratch_rank;
+    mid_ranking(rank, *order, x);
+
+    float cov = 0;
+    float e1 = 0; float e2 = 0;
+    float var1 = 0; float var2 = 0;
+    for (int i = 0; i < dim; i++) {
+        cov += rank[i] * m_center_ranks[i];
+        e1 += rank[i];
+        e2 += m_center_ranks[i];
+        var1 += rank[i] * rank[i];
+        var2 += m_center_ranks[i] * m_center_ranks[i];
+    }
+    if (dim == 0) {
+        return -0.0f;
+    }
+    e1 /= dim;
+    e2 /= dim;
+    var1 = var1/dim - e1*e1;
+    var2 = var2/dim - e2*e2;
+    if (var1 <= 0 || var2 <= 0) {
+        return -0.0f;
+    }
+    float cor = ((cov/dim) - e1*e2)/sqrt(var1*var2);
+    return -cor;
+}
+
+// Same as pearson, on ranks
+float KMeansCenterMeanSpearman::cost(float dist) const
+{
+    return 1 + dist;
+}
@@ -5,7 +5,7 @@
 #ifndef TGLKMEANS_KMEANSCENTERMEANSPEARMAN_H
 #define TGLKMEANS_KMEANSCENTERMEANSPEARMAN_H
 
-#include <list>
+#include <cmath>
 #include "KMeansCenterMean.h"
 
 class KMeansCenterMeanSpearman : public KMeansCenterMean {
@@ -13,7 +13,7 @@ protected:
     // Cached center ranks for performance optimization
     // These are pre-computed when center is updated and used when data has no missing values
     std::vector<float> m_center_ranks;
-    std::list<int> m_center_sorted_order;
+    std::vector<int> m_center_sorted_order;
 
 public:
     KMeansCenterMeanSpearman(int dim) :
@@ -22,6 +22,12 @@ public:
     {}
 
     virtual float dist(const std::vector<float> &v) const override;
+    virtual float dist(const std::vector<float> &v, const uint64_t *v_na) const override;
+    virtual float cost(float dist) const override;
+    virtual float dissimilarity(float dist) const override { return 1 + dist; }
+
+    // The row is ranked (sorted) on every call
+    virtual double dist_cost() const override { return m_center.size() * (8.0 + 8.0 * std::log2(m_center.size() + 1.0)); }
     virtual void update_center_stats() override;
 };
 
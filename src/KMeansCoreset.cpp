@@ -0,0 +1,218 @@
+//
+// Sensitivity sampling coreset for clustering very large inputs
+//
+
+#include <algorithm>
+#include "KMeansCoreset.h"
+#include "UpdateMinDistanceWorker.h"
+#include "AssignWorker.h"
+#include "Parallel.h"
+#include "Random.h"
+#include <Rcpp.h>
+
+using namespace std;
+
+// Rows per chunk of the D^2 sampling sums. Fixed rather than derived from the thread count, so that the sums (and
+// the seeds) do not depend on it.
+static const size_t SEED_CHUNK_ROWS = 65536;
+
+// Sums the D^2 sampling weights (the costs of the rows that overlap a center) of every chunk of rows
+class SeedWeightWorker : public RcppParallel::Worker {
+public:
+    const vector<float> &min_dist;
+    const KMeansCenterBase *center;
+    vector<double> &chunk_sums;
+    vector<size_t> &chunk_candidates;
+
+    SeedWeightWorker(const vector<float> &min_dist, const KMeansCenterBase *center, vector<double> &chunk_sums,
+                     vector<size_t> &chunk_candidates)
+        : min_dist(min_dist), center(center), chunk_sums(chunk_sums), chunk_candidates(chunk_candidates) {}
+
+    void operator()(size_t begin, size_t end) override {
+        for (size_t chunk = begin; chunk < end; chunk++) {
+            size_t to_i = min(min_dist.size(), (chunk + 1) * SEED_CHUNK_ROWS);
+            double sum = 0;
+            size_t candidates = 0;
+            for (size_t i = chunk * SEED_CHUNK_ROWS; i < to_i; i++) {
+                if (min_dist[i] != REAL_MAX) {
+                    sum += center->cost(min_dist[i]);
+                    candidates++;
+                }
+            }
+            chunk_sums[chunk] = sum;
+            chunk_candidates[chunk] = candidates;
+        }
+    }
+};
+
+KMeansCoreset::KMeansCoreset(const KMeansData &data, vector<KMeansCenterBase *> &centers, const bool& use_cpp_random) :
+        m_data(data),
+        m_centers(centers),
+        m_use_cpp_random(use_cpp_random),
+        m_token(nullptr) {
+}
+
+double KMeansCoreset::random_fraction() {
+    if (m_use_cpp_random){
+        return Random::fraction();
+    } else {
+        return R::runif(0, 1);
+    }
+}
+
+size_t KMeansCoreset::sample_seed(const vector<float> &min_dist, int center_i) {
+    size_t n = m_data.size();
+    if (center_i == 0) {
+        size_t seed_i = fraction_to_index(random_fraction(), n);
+        return seed_i >= n ? n - 1 : seed_i;
+    }
+
+    // D^2 sampling: rows without overlap with any center so far (REAL_MAX) are not candidates. The weights of the
+    // chunks are summed in parallel, and only the chunk holding the target is scanned.
+    size_t n_chunks = (n + SEED_CHUNK_ROWS - 1) / SEED_CHUNK_ROWS;
+    vector<double> chunk_sums(n_chunks);
+    vector<size_t> chunk_candidates(n_chunks);
+    SeedWeightWorker worker(min_dist, m_centers[0], chunk_sums, chunk_candidates);
+    Parallel::parallel_for(0, n_chunks, worker, Parallel::grain(n_chunks, 4.0 * SEED_CHUNK_ROWS));
+
+    double tot = 0;
+    for (double sum : chunk_sums) {
+        tot += sum;
+    }
+    if (tot <= 0) {
+        size_t seed_i = fraction_to_index(random_fraction(), n);
+        return seed_i >= n ? n - 1 : seed_i;
+    }
+
+    double target = random_fraction() * tot;
+    double cum = 0;
+    size_t chunk = 0;
+    while (chunk < n_chunks && cum + chunk_sums[chunk] <= target) {
+        cum += chunk_sums[chunk];
+        chunk++;
+    }
+    if (chunk == n_chunks) {
+        // Rounding left the target at the end: the last candidate is drawn
+        chunk = n_chunks - 1;
+        while (chunk_candidates[chunk] == 0) {
+            chunk--;
+        }
+        cum = -REAL_MAX;
+    }
+
+    size_t last_i = chunk * SEED_CHUNK_ROWS;
+    size_t to_i = min(n, (chunk + 1) * SEED_CHUNK_ROWS);
+    for (size_t i = chunk * SEED_CHUNK_ROWS; i < to_i; i++) {
+        if (min_dist[i] == REAL_MAX) {
+            continue;
+        }
+        cum += m_centers[0]->cost(min_dist[i]);
+        last_i = i;
+        if (cum > target) {
+            break;
+        }
+    }
+    return last_i;
+}
+
+void KMeansCoreset::run_pass(const function<void()> &pass) {
+    if (m_token != nullptr) {
+        run_cancellable(*m_token, pass);
+        m_token->check_interrupt();
+    } else {
+        pass();
+        Rcpp::checkUserInterrupt();
+    }
+}
+
+void KMeansCoreset::build(size_t size) {
+    size_t n = m_data.size();
+    int n_centers = m_centers.size();
+
+    Rcpp::Rcout << "building coreset of " << size << " out of " << n << " rows" << endl;
+
+    // Bicriteria solution. All rows are unassigned, so UpdateMinDistanceWorker keeps every row.
+    vector<float> min_dist(n, REAL_MAX);
+    vector<int> unassigned(n, -1);
+    vector<float> buf;
+
+    for (int i = 0; i < n_centers; i++) {
+        if (i > 0 && m_token != nullptr && m_token->cancelled()) {
+            // Out of time: the bicriteria solution has the centers seeded so far
+            Rcpp::Rcout << "time limit reached after " << i << " coreset seeds" << endl;
+            n_centers = i;
+            break;
+        }
+        size_t seed_i = sample_seed(min_dist, i);
+
+        m_centers[i]->reset_votes();
+        m_centers[i]->vote(m_data.row(seed_i, buf), 1, m_data.na_mask(seed_i));
+        m_centers[i]->init_to_votes();
+
+        UpdateMinDistanceWorker worker(m_data, m_centers[i], min_dist, unassigned, m_token);
+        run_pass([&]() { Parallel::parallel_for(0, n, worker, Parallel::grain(n, m_centers[i]->dist_cost())); });
+    }
+
+    // Sensitivities are bounded using the closest bicriteria center of each row. This pass is completed even after
+    // the time limit, since every row needs a center.
+    vector<KMeansCenterBase *> centers(m_centers.begin(), m_centers.begin() + n_centers);
+    vector<int> assignment(n, -1);
+    vector<float> dist(n, REAL_MAX);
+    AssignWorker assign_worker(m_data, centers, assignment, dist);
+    run_pass([&]() { Parallel::parallel_for(0, n, assign_worker, Parallel::grain(n, n_centers * m_centers[0]->dist_cost())); });
+
+    vector<double> cluster_size(n_centers, 0);
+    double tot_cost = 0;
+    for (size_t i = 0; i < n; i++) {
+        cluster_size[assignment[i]]++;
+        if (dist[i] != REAL_MAX) {
+            tot_cost += m_centers[0]->cost(dist[i]);
+        }
+    }
+
+    vector<double> sensitivity(n);
+    double tot_sensitivity = 0;
+    for (size_t i = 0; i < n; i++) {
+        double s = 1 / cluster_size[assignment[i]];
+        if (tot_cost > 0 && dist[i] != REAL_MAX) {
+            s += m_centers[0]->cost(dist[i]) / tot_cost;
+        }
+        sensitivity[i] = s;
+        tot_sensitivity += s;
+    }
+
+    // Draw 'size' rows with replacement, merging repeated draws into a single weighted row
+    vector<double> draws(size);
+    for (size_t i = 0; i < size; i++) {
+        draws[i] = random_fraction() * tot_sensitivity;
+    }
+    sort(draws.begin(), draws.end());
+
+    m_rows.clear();
+    m_weights.clear();
+    double cum = 0;
+    auto draw = draws.begin();
+    for (size_t i = 0; i < n && draw != draws.end(); i++) {
+        cum += sensitivity[i];
+        int times = 0;
+        while (draw != draws.end() && (*draw < cum || i == n - 1)) {
+            times++;
+            draw++;
+        }
+        if (times > 0) {
+            m_rows.push_back(i);
+            m_weights.push_back(times * tot_sensitivity / (sensitivity[i] * size));
+        }
+    }
+
+    Rcpp::Rcout << "coreset has " << m_rows.size() << " distinct rows" << endl;
+}
+
+void KMeansCoreset::report_data(vector<vector<float>> &data) const {
+    vector<float> buf;
+    data.clear();
+    data.reserve(m_rows.size());
+    for (size_t i : m_rows) {
+        data.push_back(m_data.row(i, buf));
+    }
+}
@@ -0,0 +1,60 @@
+//
+// Sensitivity sampling coreset for clustering very large inputs
+//
+
+#ifndef TGLKMEANS_KMEANSCORESET_H
+#define TGLKMEANS_KMEANSCORESET_H
+
+#include <functional>
+#include "Cancellation.h"
+#include "KMeansCenterBase.h"
+#include "KMeansData.h"
+
+// Reduces the data to a weighted sample of rows. A cheap bicriteria solution is
+// seeded by D^2 sampling (using UpdateMinDistanceWorker), every row gets a
+// sensitivity of cost / total_cost + 1 / cluster_size, and rows are drawn
+// proportionally to it with weight 1 / (size * p).
+class KMeansCoreset {
+protected:
+
+    const KMeansData &m_data;
+
+    // Bicriteria centers, their number sets the quality of the sensitivity bound
+    std::vector<KMeansCenterBase *> &m_centers;
+
+    std::vector<size_t> m_rows;
+
+    std::vector<float> m_weights;
+
+    bool m_use_cpp_random;
+
+    // Run cancellation (nullptr when the run cannot be stopped)
+    CancellationToken *m_token;
+
+public:
+
+    KMeansCoreset(const KMeansData &data, std::vector<KMeansCenterBase *> &centers, const bool& use_cpp_random);
+
+    // Once the token is cancelled, the bicriteria solution keeps the centers seeded so far
+    void set_cancellation(CancellationToken *token) { m_token = token; }
+
+    void build(size_t size);
+
+    void report_data(std::vector<std::vector<float>> &data) const;
+
+    const std::vector<size_t> &rows() const { return m_rows; }
+
+    const std::vector<float> &weights() const { return m_weights; }
+
+    double random_fraction();
+
+protected:
+
+    size_t sample_seed(const std::vector<float> &min_dist, int center_i);
+
+    // Runs a parallel pass, polling the token (or checking for user interrupts) while it runs
+    void run_pass(const std::function<void()> &pass);
+};
+
+
+#endif //TGLKMEANS_KMEANSCORESET_H
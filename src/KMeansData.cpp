@@ -0,0 +1,173 @@
+//
+// Storage of the rows which are clustered
+//
+
+#include <cstring>
+#include <stdexcept>
+#include "KMeansData.h"
+
+using namespace std;
+
+void KMeansData::init_na_index(size_t size) {
+    m_na_slot.assign(size, -1);
+    m_na_bits.clear();
+}
+
+bool KMeansData::has_na() const {
+    for (size_t i = 0; i < size(); i++) {
+        if (!complete(i)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+KMeansDataQuantized::KMeansDataQuantized(size_t size, size_t dim, DataPrecision precision) :
+        m_size(size),
+        m_dim(dim),
+        m_precision(precision) {
+    init_na_index(size);
+    if (m_precision == DataPrecision::int8) {
+        m_int8.resize(size * dim);
+        m_min.resize(dim, REAL_MAX);
+        m_max.resize(dim, -REAL_MAX);
+    } else {
+        m_half.resize(size * dim);
+    }
+}
+
+KMeansDataQuantized::KMeansDataQuantized(const vector<vector<float>> &rows, DataPrecision precision) :
+        KMeansDataQuantized(rows.size(), rows.empty() ? 0 : rows[0].size(), precision) {
+    for (const auto& r : rows) {
+        update_range(r.begin());
+    }
+    for (size_t i = 0; i < rows.size(); i++) {
+        set_row(i, rows[i].begin());
+    }
+}
+
+DataPrecision KMeansDataQuantized::parse_precision(const string &precision) {
+    if (precision == "float16") {
+        return DataPrecision::float16;
+    } else if (precision == "bfloat16") {
+        return DataPrecision::bfloat16;
+    } else if (precision == "int8") {
+        return DataPrecision::int8;
+    }
+    throw std::logic_error("possible data precisions are 'float32', 'float16', 'bfloat16' and 'int8'");
+}
+
+void KMeansDataQuantized::init_scales() {
+    // Map [min, max] of every column to the codes [-127, 127], -128 is reserved for missing values
+    m_scale.resize(m_dim);
+    m_offset.resize(m_dim);
+    for (size_t j = 0; j < m_dim; j++) {
+        if (m_min[j] > m_max[j]) {
+            // all values are missing
+            m_scale[j] = 0;
+            m_offset[j] = 0;
+            continue;
+        }
+        m_scale[j] = (m_max[j] - m_min[j]) / 254;
+        m_offset[j] = m_min[j] + 127 * m_scale[j];
+    }
+}
+
+static inline uint32_t float_bits(float x) {
+    uint32_t u;
+    memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+static inline float bits_float(uint32_t u) {
+    float x;
+    memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+// Round to nearest even. Values above the float16 range are clamped to the largest finite value.
+uint16_t KMeansDataQuantized::encode_float16(float x) {
+    const uint32_t f32_infty = 255u << 23;
+    const uint32_t f16_max = (127u + 16) << 23;
+    const uint32_t denorm_magic = ((127u - 15) + (23 - 10) + 1) << 23;
+
+    uint32_t u = float_bits(x);
+    uint32_t sign = u & 0x80000000u;
+    u ^= sign;
+
+    uint16_t code;
+    if (u >= f16_max) {
+        code = u > f32_infty ? FLOAT16_NA : 0x7bff;
+    } else if (u < (113u << 23)) {
+        // subnormal or zero
+        code = uint16_t(float_bits(bits_float(u) + bits_float(denorm_magic)) - denorm_magic);
+    } else {
+        uint32_t mant_odd = (u >> 13) & 1;
+        u += ((uint32_t)(15 - 127) << 23) + 0xfff;
+        u += mant_odd;
+        code = uint16_t(u >> 13);
+        if (code == 0x7c00) {
+            code = 0x7bff;
+        }
+    }
+    return code | uint16_t(sign >> 16);
+}
+
+float KMeansDataQuantized::decode_float16(uint16_t code) {
+    const float magic = bits_float((254u - 15) << 23);
+    const float was_infnan = bits_float((127u + 16) << 23);
+
+    float x = bits_float(uint32_t(code & 0x7fff) << 13) * magic;
+    uint32_t u = float_bits(x);
+    u |= x >= was_infnan ? 255u << 23 : 0;
+    u |= uint32_t(code & 0x8000) << 16;
+    return bits_float(u);
+}
+
+uint16_t KMeansDataQuantized::encode_bfloat16(float x) {
+    uint32_t u = float_bits(x);
+    if ((u & 0x7fffffffu) > 0x7f800000u) {
+        return BFLOAT16_NA;
+    }
+    u += 0x7fff + ((u >> 16) & 1);
+    return uint16_t(u >> 16);
+}
+
+float KMeansDataQuantized::decode_bfloat16(uint16_t code) {
+    return bits_float(uint32_t(code) << 16);
+}
+
+// The decoding loops are branch free so that the compiler can vectorize them
+const vector<float> &KMeansDataQuantized::row(size_t i, vector<float> &buf) const {
+    buf.resize(m_dim);
+    float* out = buf.data();
+    switch (m_precision) {
+        case DataPrecision::float16: {
+            const uint16_t* codes = m_half.data() + i * m_dim;
+            for (size_t j = 0; j < m_dim; j++) {
+                float val = decode_float16(codes[j]);
+                out[j] = codes[j] == FLOAT16_NA ? REAL_MAX : val;
+            }
+            break;
+        }
+        case DataPrecision::bfloat16: {
+            const uint16_t* codes = m_half.data() + i * m_dim;
+            for (size_t j = 0; j < m_dim; j++) {
+                float val = decode_bfloat16(codes[j]);
+                out[j] = codes[j] == BFLOAT16_NA ? REAL_MAX : val;
+            }
+            break;
+        }
+        case DataPrecision::int8: {
+            const int8_t* codes = m_int8.data() + i * m_dim;
+            const float* scale = m_scale.data();
+            const float* offset = m_offset.data();
+            for (size_t j = 0; j < m_dim; j++) {
+                float val = offset[j] + scale[j] * codes[j];
+                out[j] = codes[j] == INT8_NA ? REAL_MAX : val;
+            }
+            break;
+        }
+    }
+    return buf;
+}
@@ -0,0 +1,214 @@
+//
+// Storage of the rows which are clustered
+//
+
+#ifndef TGLKMEANS_KMEANSDATA_H
+#define TGLKMEANS_KMEANSDATA_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cmath>
+#include "KMeansCenterBase.h"
+
+// Rows are handed to the centers as float vectors. Implementations that store the
+// rows in another representation decode them into the caller's buffer.
+// Rows are classified at ingestion as complete or incomplete, and the incomplete rows keep
+// a bitmap of their missing dimensions, so that the centers can skip the per value NA tests.
+class KMeansData {
+protected:
+    // Index of the NA bitmap of each row in m_na_bits, -1 for complete rows
+    std::vector<int64_t> m_na_slot;
+    std::vector<uint64_t> m_na_bits;
+
+    void init_na_index(size_t size);
+
+    // Records the missing values of row i (values equal to REAL_MAX). Called once per row at ingestion.
+    template<class It> void index_row_na(size_t i, It begin);
+
+public:
+    virtual ~KMeansData() = default;
+
+    virtual size_t size() const = 0;
+
+    virtual size_t dim() const = 0;
+
+    // Returns row i. buf is scratch space of the calling thread, which may be used for decoding
+    virtual const std::vector<float> &row(size_t i, std::vector<float> &buf) const = 0;
+
+    virtual bool complete(size_t i) const { return m_na_slot[i] < 0; }
+
+    // NA bitmap of row i (bit d is set if dimension d is missing, see na_bit()), nullptr for complete rows
+    virtual const uint64_t *na_mask(size_t i) const {
+        return m_na_slot[i] < 0 ? nullptr : &m_na_bits[m_na_slot[i] * na_words()];
+    }
+
+    size_t na_words() const { return (dim() + 63) / 64; }
+
+    // Whether any of the rows has a missing value
+    bool has_na() const;
+};
+
+template<class It>
+void KMeansData::index_row_na(size_t i, It begin) {
+    size_t d = dim();
+    It x = begin;
+    size_t j = 0;
+    for (; j < d; j++, x++) {
+        if (*x == REAL_MAX) {
+            break;
+        }
+    }
+    if (j == d) {
+        return;
+    }
+    size_t words = na_words();
+    m_na_slot[i] = m_na_bits.size() / words;
+    m_na_bits.resize(m_na_bits.size() + words, 0);
+    uint64_t *bits = &m_na_bits[m_na_slot[i] * words];
+    for (; j < d; j++, x++) {
+        if (*x == REAL_MAX) {
+            bits[j >> 6] |= uint64_t(1) << (j & 63);
+        }
+    }
+}
+
+class KMeansDataFloat : public KMeansData {
+protected:
+    const std::vector<std::vector<float>> &m_rows;
+
+public:
+    KMeansDataFloat(const std::vector<std::vector<float>> &rows) :
+            m_rows(rows) {
+        init_na_index(rows.size());
+        for (size_t i = 0; i < rows.size(); i++) {
+            index_row_na(i, rows[i].begin());
+        }
+    }
+
+    virtual size_t size() const override { return m_rows.size(); }
+
+    virtual size_t dim() const override { return m_rows.empty() ? 0 : m_rows[0].size(); }
+
+    virtual const std::vector<float> &row(size_t i, std::vector<float> &buf) const override { return m_rows[i]; }
+};
+
+// A subset of the rows of another data object (e.g. the members of a cluster)
+class KMeansDataSubset : public KMeansData {
+protected:
+    const KMeansData &m_data;
+    const std::vector<size_t> &m_rows;
+
+public:
+    KMeansDataSubset(const KMeansData &data, const std::vector<size_t> &rows) :
+            m_data(data),
+            m_rows(rows) {}
+
+    virtual size_t size() const override { return m_rows.size(); }
+
+    virtual size_t dim() const override { return m_data.dim(); }
+
+    virtual const std::vector<float> &row(size_t i, std::vector<float> &buf) const override { return m_data.row(m_rows[i], buf); }
+
+    virtual bool complete(size_t i) const override { return m_data.complete(m_rows[i]); }
+
+    virtual const uint64_t *na_mask(size_t i) const override { return m_data.na_mask(m_rows[i]); }
+};
+
+enum class DataPrecision { float16, bfloat16, int8 };
+
+// Compressed storage: 2 bytes per value for float16/bfloat16 and 1 byte per value for int8
+// (per column scale and offset). Missing values (REAL_MAX) are stored as a reserved code.
+class KMeansDataQuantized : public KMeansData {
+protected:
+    size_t m_size;
+    size_t m_dim;
+    DataPrecision m_precision;
+
+    std::vector<uint16_t> m_half;   // float16/bfloat16 codes, row major
+    std::vector<int8_t> m_int8;     // int8 codes, row major
+    std::vector<float> m_scale;     // int8: value = offset + scale * code
+    std::vector<float> m_offset;
+    std::vector<float> m_min;
+    std::vector<float> m_max;
+
+public:
+    static const uint16_t FLOAT16_NA = 0x7e00;
+    // Largest finite float16 value, larger values are clamped to it
+    static constexpr float FLOAT16_MAX = 65504;
+    static const uint16_t BFLOAT16_NA = 0x7fc0;
+    static const int8_t INT8_NA = -128;
+
+    KMeansDataQuantized(size_t size, size_t dim, DataPrecision precision);
+
+    KMeansDataQuantized(const std::vector<std::vector<float>> &rows, DataPrecision precision);
+
+    static DataPrecision parse_precision(const std::string &precision);
+
+    // int8 only: every row has to be passed to update_range before the first set_row
+    template<class It> void update_range(It begin);
+
+    template<class It> void set_row(size_t i, It begin);
+
+    virtual size_t size() const override { return m_size; }
+
+    virtual size_t dim() const override { return m_dim; }
+
+    virtual const std::vector<float> &row(size_t i, std::vector<float> &buf) const override;
+
+    static uint16_t encode_float16(float x);
+    static float decode_float16(uint16_t code);
+    static uint16_t encode_bfloat16(float x);
+    static float decode_bfloat16(uint16_t code);
+
+protected:
+    void init_scales();
+};
+
+template<class It>
+void KMeansDataQuantized::update_range(It begin) {
+    if (m_precision != DataPrecision::int8) {
+        return;
+    }
+    It x = begin;
+    for (size_t j = 0; j < m_dim; j++, x++) {
+        float val = *x;
+        if (val != REAL_MAX) {
+            m_min[j] = val < m_min[j] ? val : m_min[j];
+            m_max[j] = val > m_max[j] ? val : m_max[j];
+        }
+    }
+}
+
+template<class It>
+void KMeansDataQuantized::set_row(size_t i, It begin) {
+    if (m_precision == DataPrecision::int8 && m_scale.empty()) {
+        init_scales();
+    }
+    index_row_na(i, begin);
+    It x = begin;
+    for (size_t j = 0; j < m_dim; j++, x++) {
+        float val = *x;
+        size_t idx = i * m_dim + j;
+        switch (m_precision) {
+            case DataPrecision::float16:
+                m_half[idx] = val == REAL_MAX ? FLOAT16_NA : encode_float16(val);
+                break;
+            case DataPrecision::bfloat16:
+                m_half[idx] = val == REAL_MAX ? BFLOAT16_NA : encode_bfloat16(val);
+                break;
+            case DataPrecision::int8:
+                if (val == REAL_MAX) {
+                    m_int8[idx] = INT8_NA;
+                } else {
+                    float code = m_scale[j] > 0 ? (val - m_offset[j]) / m_scale[j] : 0;
+                    code = code < -127 ? -127 : (code > 127 ? 127 : code);
+                    m_int8[idx] = (int8_t) std::lround(code);
+                }
+                break;
+        }
+    }
+}
+
+
+#endif //TGLKMEANS_KMEANSDATA_H
@@ -0,0 +1,268 @@
+//
+// Bisecting (hierarchical) k-means for large k
+//
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include "Parallel.h"
+#include <Rcpp.h>
+#include "KMeansHierarchical.h"
+#include "KMeansCenterFactory.h"
+#include "KMeans.h"
+#include "Random.h"
+
+using namespace std;
+
+// Splits a batch of leaves, one leaf per index
+class SplitWorker : public RcppParallel::Worker {
+private:
+    KMeansHierarchical &hierarchical;
+    const vector<int> &leaves;
+    unsigned int seed;
+    int max_iter;
+    float min_delta_assign;
+
+public:
+    SplitWorker(KMeansHierarchical &hierarchical, const vector<int> &leaves, unsigned int seed, int max_iter, float min_delta_assign)
+        : hierarchical(hierarchical), leaves(leaves), seed(seed), max_iter(max_iter), min_delta_assign(min_delta_assign) {}
+
+    void operator()(std::size_t begin, std::size_t end) override {
+        for (std::size_t i = begin; i < end; i++) {
+            // every leaf gets its own random stream so that results do not depend on scheduling
+            hierarchical.split(leaves[i], seed + leaves[i], max_iter, min_delta_assign);
+        }
+    }
+};
+
+KMeansHierarchical::KMeansHierarchical(const KMeansData &data, int k, vector<KMeansCenterBase *> &centers, const string &metric,
+                                       const bool& use_cpp_random, const vector<float> &weights) :
+        m_data(data),
+        m_k(k),
+        m_centers(centers),
+        m_metric(metric),
+        m_weights(weights),
+        m_use_cpp_random(use_cpp_random),
+        m_token(nullptr),
+        m_converged(false) {
+}
+
+float KMeansHierarchical::random_fraction() {
+    if (m_use_cpp_random){
+        return Random::fraction();
+    } else {
+        return R::runif(0, 1);
+    }
+}
+
+void KMeansHierarchical::split(int node_i, unsigned int seed, int max_iter, float min_delta_assign) {
+    // Runs inside a worker thread: children are created by the caller after the round
+    Node &node = m_nodes[node_i];
+
+    KMeansDataSubset rows(m_data, node.rows);
+    vector<float> weights;
+    if (!m_weights.empty()) {
+        weights.reserve(node.rows.size());
+        for (size_t i : node.rows) {
+            weights.push_back(m_weights[i]);
+        }
+    }
+
+    vector<unique_ptr<KMeansCenterBase>> owned_centers;
+    vector<KMeansCenterBase *> centers;
+    create_centers(m_metric, 2, m_data.dim(), owned_centers, centers);
+
+    // A bad bisection cannot be undone later, so keep the best of a few 2-means runs
+    vector<int> best_assignment;
+    double best_cost[2] = {0, 0};
+    vector<float> buf;
+    for (int trial = 0; trial < SPLIT_TRIALS; trial++) {
+        vector<int> assignment;
+        try {
+            KMeans kmeans(rows, 2, centers, false, weights);
+            kmeans.set_nested(seed + trial * 7919);
+            kmeans.set_cancellation(m_token);
+            kmeans.cluster(max_iter, min_delta_assign);
+            assignment = kmeans.report_assignment_to_vector();
+        } catch (const std::logic_error &e) {
+            // No valid seed in the rows of the node (e.g. all of them missing the same values). Other errors
+            // propagate and stop the run.
+            node.split_error = e.what();
+            continue;
+        }
+
+        double cost[2] = {0, 0};
+        size_t n_left = 0;
+        for (size_t i = 0; i < assignment.size(); i++) {
+            int side = assignment[i];
+            float dist = centers[side]->dist(rows.row(i, buf), rows.na_mask(i));
+            if (dist != REAL_MAX) {
+                cost[side] += centers[side]->cost(dist) * (weights.empty() ? 1 : weights[i]);
+            }
+            n_left += side == 0;
+        }
+        if (n_left == 0 || n_left == assignment.size()) {
+            continue;
+        }
+        if (best_assignment.empty() || cost[0] + cost[1] < best_cost[0] + best_cost[1]) {
+            best_assignment.swap(assignment);
+            best_cost[0] = cost[0];
+            best_cost[1] = cost[1];
+        }
+    }
+
+    if (best_assignment.empty()) {
+        node.splittable = false;
+        return;
+    }
+    for (size_t i = 0; i < best_assignment.size(); i++) {
+        (best_assignment[i] == 0 ? node.left : node.right).push_back(node.rows[i]);
+    }
+    node.left_cost = best_cost[0];
+    node.right_cost = best_cost[1];
+}
+
+void KMeansHierarchical::cluster(int max_iter, float min_delta_assign, int refine_iter) {
+    Rcpp::Rcout << "hierarchical clustering to " << m_k << " leaves" << endl;
+
+    Node root;
+    root.parent = -1;
+    root.cost = 0;
+    root.splittable = true;
+    root.clust = -1;
+    root.rows.resize(m_data.size());
+    for (size_t i = 0; i < m_data.size(); i++) {
+        root.rows[i] = i;
+    }
+    m_nodes.push_back(root);
+
+    vector<int> leaves = {0};
+    unsigned int seed = random_fraction() * 2147483647;
+
+    while ((int)leaves.size() < m_k) {
+        // Split the leaves with the highest cost, as many as needed to reach k (each split adds a single leaf)
+        vector<int> candidates;
+        for (int leaf : leaves) {
+            if (m_nodes[leaf].splittable && m_nodes[leaf].rows.size() >= 2) {
+                candidates.push_back(leaf);
+            }
+        }
+        if (candidates.empty()) {
+            break;
+        }
+        stable_sort(candidates.begin(), candidates.end(), [&](int a, int b) {
+            return m_nodes[a].cost > m_nodes[b].cost;
+        });
+        candidates.resize(min(candidates.size(), size_t(m_k - leaves.size())));
+
+        Rcpp::Rcout << "splitting " << candidates.size() << " out of " << leaves.size() << " leaves" << endl;
+        SplitWorker worker(*this, candidates, seed, max_iter, min_delta_assign);
+        if (m_token != nullptr) {
+            run_cancellable(*m_token, [&]() { Parallel::parallel_for(0, candidates.size(), worker, 1); });
+            m_token->check_interrupt();
+        } else {
+            Parallel::parallel_for(0, candidates.size(), worker, 1);
+        }
+
+        for (int leaf : candidates) {
+            if (m_nodes[leaf].left.empty()) {
+                if (!m_nodes[leaf].splittable && !m_nodes[leaf].split_error.empty()) {
+                    Rcpp::Rcout << "could not split a leaf of " << m_nodes[leaf].rows.size() << " rows: "
+                                << m_nodes[leaf].split_error << endl;
+                }
+                continue;
+            }
+            for (int side = 0; side < 2; side++) {
+                Node child;
+                child.parent = leaf;
+                child.splittable = true;
+                child.clust = -1;
+                child.cost = side == 0 ? m_nodes[leaf].left_cost : m_nodes[leaf].right_cost;
+                child.rows.swap(side == 0 ? m_nodes[leaf].left : m_nodes[leaf].right);
+                m_nodes[leaf].children.push_back(m_nodes.size());
+                m_nodes.push_back(std::move(child));
+            }
+            vector<size_t>().swap(m_nodes[leaf].rows);
+        }
+
+        leaves.clear();
+        for (size_t i = 0; i < m_nodes.size(); i++) {
+            if (m_nodes[i].children.empty()) {
+                leaves.push_back(i);
+            }
+        }
+        if (m_token != nullptr) {
+            m_token->check_interrupt();
+            if (m_token->timed_out()) {
+                Rcpp::Rcout << "time limit reached with " << leaves.size() << " leaves" << endl;
+                break;
+            }
+        } else {
+            Rcpp::checkUserInterrupt();
+        }
+    }
+
+    if ((int)leaves.size() < m_k && !(m_token != nullptr && m_token->timed_out())) {
+        Rcpp::Rcout << "no more leaves could be split, the tree has " << leaves.size() << " of " << m_k << " leaves" << endl;
+    }
+
+    number_leaves();
+
+    // Centers of the leaves, optionally refined by global Lloyd iterations
+    KMeans kmeans(m_data, m_k, m_centers, m_use_cpp_random, m_weights);
+    kmeans.set_cancellation(m_token);
+    kmeans.refine(m_assignment, refine_iter, min_delta_assign);
+    m_assignment = kmeans.report_assignment_to_vector();
+    m_converged = !(m_token != nullptr && m_token->timed_out()) && (refine_iter == 0 || kmeans.converged());
+}
+
+void KMeansHierarchical::number_leaves() {
+    // Leaves are numbered in depth first order, so that cluster ids follow the tree
+    m_assignment.assign(m_data.size(), 0);
+    int clust = 0;
+    vector<int> stack = {0};
+    while (!stack.empty()) {
+        int node_i = stack.back();
+        stack.pop_back();
+        Node &node = m_nodes[node_i];
+        if (node.children.empty()) {
+            node.clust = clust;
+            for (size_t i : node.rows) {
+                m_assignment[i] = clust;
+            }
+            clust++;
+        } else {
+            stack.push_back(node.children[1]);
+            stack.push_back(node.children[0]);
+        }
+    }
+}
+
+void KMeansHierarchical::report_centers_to_vector(vector<vector<float>> &centers) {
+    for (int i = 0; i < m_k; i++) {
+        centers.push_back(m_centers[i]->report_vector());
+    }
+}
+
+void KMeansHierarchical::report_tree(vector<int> &node, vector<int> &parent, vector<int> &size, vector<int> &clust) const {
+    // Leaf sizes are taken from the final (possibly refined) assignment and summed up the tree
+    vector<int> clust_size(m_k, 0);
+    for (int clust : m_assignment) {
+        clust_size[clust]++;
+    }
+    vector<int> sizes(m_nodes.size(), 0);
+    for (int i = m_nodes.size() - 1; i >= 0; i--) {
+        if (m_nodes[i].clust >= 0) {
+            sizes[i] = clust_size[m_nodes[i].clust];
+        }
+        if (m_nodes[i].parent >= 0) {
+            sizes[m_nodes[i].parent] += sizes[i];
+        }
+    }
+    for (size_t i = 0; i < m_nodes.size(); i++) {
+        node.push_back(i);
+        parent.push_back(m_nodes[i].parent);
+        size.push_back(sizes[i]);
+        clust.push_back(m_nodes[i].clust);
+    }
+}
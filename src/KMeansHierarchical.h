@@ -0,0 +1,85 @@
+//
+// Bisecting (hierarchical) k-means for large k
+//
+
+#ifndef TGLKMEANS_KMEANSHIERARCHICAL_H
+#define TGLKMEANS_KMEANSHIERARCHICAL_H
+
+#include <string>
+#include "KMeansCenterBase.h"
+#include "KMeansData.h"
+#include "Cancellation.h"
+
+// Builds k clusters by recursively splitting the leaves with the highest cost with 2-means runs of
+// the KMeans engine. All the leaves that are split in the same round are independent and
+// run in parallel. The leaves can then be refined by a few global Lloyd iterations.
+class KMeansHierarchical {
+protected:
+
+    struct Node {
+        int parent;
+        std::vector<size_t> rows;
+        double cost;    // sum of the cost of the rows relative to the node center
+        bool splittable;
+        int clust;
+        std::vector<int> children;
+        std::vector<size_t> left;  // result of split(), moved to the children after the round
+        std::vector<size_t> right;
+        double left_cost = 0;
+        double right_cost = 0;
+        std::string split_error;   // why the 2-means runs of split() failed, if they did
+    };
+
+    static const int SPLIT_TRIALS = 3;
+
+    const KMeansData &m_data;
+
+    int m_k;
+
+    std::vector<KMeansCenterBase *> &m_centers;
+
+    std::string m_metric;
+
+    std::vector<float> m_weights;
+
+    bool m_use_cpp_random;
+
+    std::vector<Node> m_nodes;
+
+    std::vector<int> m_assignment;
+
+    CancellationToken *m_token;
+
+    bool m_converged;
+
+public:
+
+    KMeansHierarchical(const KMeansData &data, int k, std::vector<KMeansCenterBase *> &centers, const std::string &metric,
+                       const bool& use_cpp_random, const std::vector<float> &weights);
+
+    void cluster(int max_iter, float min_delta_assign, int refine_iter);
+
+    void set_cancellation(CancellationToken *token) { m_token = token; }
+
+    // Not stopped by the time limit, and the refinement (if any) converged
+    bool converged() const { return m_converged; }
+
+    std::vector<int> report_assignment_to_vector() const { return m_assignment; }
+
+    void report_centers_to_vector(std::vector<std::vector<float>> &centers);
+
+    // Nodes in creation order. Leaves have clust >= 0 and internal nodes have clust = -1.
+    void report_tree(std::vector<int> &node, std::vector<int> &parent, std::vector<int> &size, std::vector<int> &clust) const;
+
+    float random_fraction();
+
+    // Thread safe: only touches the given node
+    void split(int node_i, unsigned int seed, int max_iter, float min_delta_assign);
+
+protected:
+
+    void number_leaves();
+};
+
+
+#endif //TGLKMEANS_KMEANSHIERARCHICAL_H
@@ -0,0 +1,109 @@
+//
+// k-means runs for several values of k over the same data
+//
+
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <memory>
+#include "Parallel.h"
+#include <Rcpp.h>
+#include "KMeansSweep.h"
+#include "KMeansCenterFactory.h"
+#include "KMeans.h"
+#include "Random.h"
+
+using namespace std;
+
+// Runs a batch of values of k, one per index
+class SweepWorker : public RcppParallel::Worker {
+private:
+    KMeansSweep &sweep;
+    const vector<size_t> &order;
+    unsigned int seed;
+    int max_iter;
+    float min_delta_assign;
+
+public:
+    SweepWorker(KMeansSweep &sweep, const vector<size_t> &order, unsigned int seed, int max_iter, float min_delta_assign)
+        : sweep(sweep), order(order), seed(seed), max_iter(max_iter), min_delta_assign(min_delta_assign) {}
+
+    void operator()(std::size_t begin, std::size_t end) override {
+        for (std::size_t i = begin; i < end; i++) {
+            sweep.run(order[i], seed, max_iter, min_delta_assign);
+        }
+    }
+};
+
+KMeansSweep::KMeansSweep(const KMeansData &data, const vector<int> &ks, const string &metric, const bool& use_cpp_random) :
+        m_data(data),
+        m_ks(ks),
+        m_metric(metric),
+        m_use_cpp_random(use_cpp_random),
+        m_token(nullptr) {
+}
+
+float KMeansSweep::random_fraction() {
+    if (m_use_cpp_random){
+        return Random::fraction();
+    } else {
+        return R::runif(0, 1);
+    }
+}
+
+void KMeansSweep::run(size_t i, unsigned int seed, int max_iter, float min_delta_assign) {
+    // Runs inside a worker thread
+    Result &result = m_results[i];
+    result.k = m_ks[i];
+
+    vector<unique_ptr<KMeansCenterBase>> owned_centers;
+    vector<KMeansCenterBase *> centers;
+    create_centers(m_metric, result.k, m_data.dim(), owned_centers, centers);
+
+    try {
+        KMeans kmeans(m_data, result.k, centers, false);
+        // every k gets its own random stream so that results do not depend on scheduling
+        kmeans.set_nested(seed + result.k);
+        kmeans.set_cancellation(m_token);
+        kmeans.cluster(max_iter, min_delta_assign);
+        result.assignment = kmeans.report_assignment_to_vector();
+        result.objective = kmeans.objective();
+        result.converged = kmeans.converged();
+    } catch (const std::exception &e) {
+        result.error = e.what();
+        return;
+    }
+
+    result.size.assign(result.k, 0);
+    for (int clust : result.assignment) {
+        if (clust >= 0) {
+            result.size[clust]++;
+        }
+    }
+}
+
+void KMeansSweep::cluster(int max_iter, float min_delta_assign) {
+    Rcpp::Rcout << "clustering for " << m_ks.size() << " values of k" << endl;
+
+    m_results.assign(m_ks.size(), Result());
+    unsigned int seed = random_fraction() * 2147483647;
+
+    // Largest k first, so that the longest runs do not start last
+    vector<size_t> order(m_ks.size());
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return m_ks[a] > m_ks[b]; });
+
+    SweepWorker worker(*this, order, seed, max_iter, min_delta_assign);
+    if (m_token != nullptr) {
+        run_cancellable(*m_token, [&]() { Parallel::parallel_for(0, order.size(), worker, 1); });
+        m_token->check_interrupt();
+    } else {
+        Parallel::parallel_for(0, order.size(), worker, 1);
+    }
+
+    for (const Result &result : m_results) {
+        if (!result.error.empty()) {
+            throw std::logic_error("k = " + to_string(result.k) + ": " + result.error);
+        }
+    }
+}
@@ -0,0 +1,60 @@
+//
+// k-means runs for several values of k over the same data
+//
+
+#ifndef TGLKMEANS_KMEANSSWEEP_H
+#define TGLKMEANS_KMEANSSWEEP_H
+
+#include <string>
+#include "KMeansData.h"
+#include "Cancellation.h"
+
+// Clusters the same data for every k in a list, to choose k. The data is encoded once and shared by
+// all the runs, and the runs are independent KMeans instances that run in parallel (each one with
+// its own random stream, so that results do not depend on scheduling). The runs of large k take the
+// longest and are started first.
+class KMeansSweep {
+public:
+
+    struct Result {
+        int k;
+        std::vector<int> assignment;
+        std::vector<int> size;
+        double objective;   // sum of the cost of the rows relative to their centers
+        bool converged;
+        std::string error;  // set if the run failed
+    };
+
+protected:
+
+    const KMeansData &m_data;
+
+    std::vector<int> m_ks;
+
+    std::string m_metric;
+
+    bool m_use_cpp_random;
+
+    std::vector<Result> m_results;
+
+    CancellationToken *m_token;
+
+public:
+
+    KMeansSweep(const KMeansData &data, const std::vector<int> &ks, const std::string &metric, const bool& use_cpp_random);
+
+    void cluster(int max_iter, float min_delta_assign);
+
+    void set_cancellation(CancellationToken *token) { m_token = token; }
+
+    // In the order of the given ks
+    const std::vector<Result> &results() const { return m_results; }
+
+    float random_fraction();
+
+    // Thread safe: only touches the result of run i
+    void run(size_t i, unsigned int seed, int max_iter, float min_delta_assign);
+};
+
+
+#endif //TGLKMEANS_KMEANSSWEEP_H
@@ -0,0 +1,115 @@
+//
+// The package's single task scheduler for the native kernels
+//
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <unistd.h>
+#include "Parallel.h"
+
+int Parallel::m_max_threads = std::max(1u, std::thread::hardware_concurrency());
+int Parallel::m_r_workers = 1;
+long Parallel::m_owner_pid = (long) getpid();
+size_t Parallel::m_grain = 0;
+bool Parallel::m_affinity = false;
+thread_local int Parallel::m_depth = 0;
+
+// Arithmetic operations per chunk that amortize scheduling a task (a few microseconds of work)
+static const double MIN_CHUNK_COST = 20000;
+
+// Chunks per thread, so that uneven items (e.g. rows with missing values) are balanced
+static const size_t CHUNKS_PER_THREAD = 8;
+
+#if RCPP_PARALLEL_USE_TBB
+std::unique_ptr<tbb::task_arena> Parallel::m_arena;
+long Parallel::m_arena_pid = 0;
+#endif
+
+void Parallel::configure(int max_threads, int r_workers, size_t grain, bool affinity) {
+    m_max_threads = std::max(1, max_threads);
+    m_r_workers = std::min(m_max_threads, std::max(1, r_workers));
+    m_grain = grain;
+    m_affinity = affinity;
+    m_owner_pid = (long) getpid();
+#if RCPP_PARALLEL_USE_TBB
+    // Rebuilt with the new cap on the next loop
+    if (m_arena_pid == m_owner_pid) {
+        m_arena.reset();
+    }
+#endif
+}
+
+bool Parallel::forked() {
+    return (long) getpid() != m_owner_pid;
+}
+
+int Parallel::threads() {
+    if (forked()) {
+        return std::max(1, m_max_threads / m_r_workers);
+    }
+    return m_max_threads;
+}
+
+size_t Parallel::grain(size_t n, double item_cost) {
+    if (m_grain > 0) {
+        return m_grain;
+    }
+    size_t balanced = n / (threads() * CHUNKS_PER_THREAD);
+    size_t amortized = (size_t) std::ceil(MIN_CHUNK_COST / std::max(item_cost, 1.0));
+    return std::max((size_t) 1, std::max(balanced, amortized));
+}
+
+std::vector<std::pair<size_t, size_t>> Parallel::cost_ranges(const std::vector<double> &costs) {
+    double total = 0;
+    for (double cost : costs) {
+        total += cost;
+    }
+    double range_cost = std::max(MIN_CHUNK_COST, total / (threads() * CHUNKS_PER_THREAD));
+
+    std::vector<std::pair<size_t, size_t>> ranges;
+    std::vector<double> range_costs;
+    size_t first = 0;
+    double cost = 0;
+    for (size_t i = 0; i < costs.size(); i++) {
+        // The range is closed before the item that would take it over the range cost, so an item costing more
+        // than a range is left alone in its own
+        if (i > first && (cost + costs[i] > range_cost)) {
+            ranges.emplace_back(first, i);
+            range_costs.push_back(cost);
+            first = i;
+            cost = 0;
+        }
+        cost += costs[i];
+    }
+    if (first < costs.size()) {
+        ranges.emplace_back(first, costs.size());
+        range_costs.push_back(cost);
+    }
+
+    std::vector<size_t> order(ranges.size());
+    for (size_t r = 0; r < order.size(); r++) {
+        order[r] = r;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return range_costs[a] > range_costs[b]; });
+    std::vector<std::pair<size_t, size_t>> sorted(ranges.size());
+    for (size_t r = 0; r < order.size(); r++) {
+        sorted[r] = ranges[order[r]];
+    }
+    return sorted;
+}
+
+#if RCPP_PARALLEL_USE_TBB
+tbb::task_arena &Parallel::arena() {
+    long pid = (long) getpid();
+    if (m_arena && m_arena_pid != pid) {
+        // Inherited from the parent by a fork, its threads do not exist in this process
+        m_arena.release();
+    }
+    if (!m_arena) {
+        m_arena.reset(new tbb::task_arena(threads()));
+        m_arena_pid = pid;
+    }
+    return *m_arena;
+}
+#endif
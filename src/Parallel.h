@@ -0,0 +1,226 @@
+//
+// The package's single task scheduler for the native kernels
+//
+
+#ifndef TGLKMEANS_PARALLEL_H
+#define TGLKMEANS_PARALLEL_H
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <RcppParallel.h>
+
+// All the native kernels submit their parallel loops through Parallel::parallel_for and
+// Parallel::parallel_reduce instead of calling RcppParallel directly. The loops run in one task arena
+// capped at threads(), so:
+//  * a loop started from inside another loop (e.g. the k-means runs of a hierarchical split round)
+//    joins the enclosing arena instead of adding threads of its own.
+//  * a process forked by an R-level parallel backend (future::multicore, mclapply) gets its share of
+//    the total budget, max_threads() / r_workers(), so R workers x native threads stays within the cap.
+// Loops are cut into chunks of grain() items, picked from the estimated cost of an item (see grain()).
+
+// Remembers which thread ran each chunk of a loop that is repeated over the same items (e.g. reassigning
+// the rows in every iteration). When affinity is on, the next run replays the mapping, so that the rows
+// stay in the caches and memory node of the thread that processed them before.
+class ParallelAffinity {
+#if RCPP_PARALLEL_USE_TBB
+private:
+    std::unique_ptr<tbb::affinity_partitioner> m_partitioner;
+
+public:
+    tbb::affinity_partitioner &partitioner() {
+        if (!m_partitioner) {
+            m_partitioner.reset(new tbb::affinity_partitioner());
+        }
+        return *m_partitioner;
+    }
+#endif
+};
+
+// Runs a worker over ranges of items listed apart (see Parallel::parallel_for_costs), a range per index
+template<typename Worker>
+class RangesWorker : public RcppParallel::Worker {
+private:
+    const std::vector<std::pair<size_t, size_t>> &m_ranges;
+    Worker &m_worker;
+
+public:
+    RangesWorker(const std::vector<std::pair<size_t, size_t>> &ranges, Worker &worker) : m_ranges(ranges), m_worker(worker) {}
+
+    void operator()(size_t begin, size_t end) override {
+        for (size_t r = begin; r < end; r++) {
+            m_worker(m_ranges[r].first, m_ranges[r].second);
+        }
+    }
+};
+
+class Parallel {
+private:
+    // Total concurrency of the package, and how many R-level workers share it
+    static int m_max_threads;
+    static int m_r_workers;
+
+    // The process that configured the scheduler, used to detect forked R workers
+    static long m_owner_pid;
+
+    // Fixed grain size (0 picks it from the cost model) and whether loops replay their thread affinity
+    static size_t m_grain;
+    static bool m_affinity;
+
+    // Depth of parallel loops on the current thread
+    static thread_local int m_depth;
+
+    // Marks the current thread as running a loop body
+    struct Scope {
+        Scope() { ++m_depth; }
+
+        ~Scope() { --m_depth; }
+    };
+
+#if RCPP_PARALLEL_USE_TBB
+    static std::unique_ptr<tbb::task_arena> m_arena;
+    static long m_arena_pid;
+
+    static tbb::task_arena &arena();
+
+    template<typename Worker>
+    struct ReduceBody {
+        Worker *worker;
+        std::unique_ptr<Worker> owned;
+
+        ReduceBody(Worker &w) : worker(&w) {}
+
+        ReduceBody(ReduceBody &other, tbb::split) : owned(new Worker(*other.worker, RcppParallel::Split())) {
+            worker = owned.get();
+        }
+
+        void operator()(const tbb::blocked_range<size_t> &r) {
+            Scope scope;
+            (*worker)(r.begin(), r.end());
+        }
+
+        void join(const ReduceBody &other) {
+            worker->join(*other.worker);
+        }
+    };
+#endif
+
+public:
+    // Called from R (tglkmeans.set_parallel)
+    static void configure(int max_threads, int r_workers, size_t grain = 0, bool affinity = false);
+
+    static int max_threads() { return m_max_threads; }
+
+    static int r_workers() { return m_r_workers; }
+
+    // The configured grain size (0 when the cost model picks it)
+    static size_t fixed_grain() { return m_grain; }
+
+    static bool affinity() { return m_affinity; }
+
+    // True in a process forked from the one that configured the scheduler
+    static bool forked();
+
+    // True when called from inside a parallel loop
+    static bool nested() { return m_depth > 0; }
+
+    // Threads available to the native loops of this process
+    static int threads();
+
+    // Number of items per chunk for a loop over n items, each costing about item_cost arithmetic operations.
+    // Chunks are large enough to amortize the scheduling overhead, and small enough to give every thread
+    // several chunks to balance the load, unless the configured grain overrides it.
+    static size_t grain(size_t n, double item_cost);
+
+    // Cuts the items [0, costs.size()) into ranges of consecutive items of about equal total cost, given the
+    // estimated cost of every item in arithmetic operations, and orders them by decreasing cost. An item costing
+    // more than a range is a range of its own.
+    static std::vector<std::pair<size_t, size_t>> cost_ranges(const std::vector<double> &costs);
+
+    // affinity (optional) is the affinity of this loop from its previous runs
+    template<typename Worker>
+    static void parallel_for(size_t begin, size_t end, Worker &worker, size_t grain, ParallelAffinity *affinity = nullptr) {
+        if (begin >= end) {
+            return;
+        }
+        if (threads() <= 1) {
+            Scope scope;
+            worker(begin, end);
+            return;
+        }
+#if RCPP_PARALLEL_USE_TBB
+        auto body = [&](const tbb::blocked_range<size_t> &r) {
+            Scope scope;
+            worker(r.begin(), r.end());
+        };
+        auto loop = [&]() {
+            tbb::blocked_range<size_t> range(begin, end, grain);
+            if (affinity != nullptr && m_affinity) {
+                tbb::parallel_for(range, body, affinity->partitioner());
+            } else {
+                tbb::parallel_for(range, body, tbb::simple_partitioner());
+            }
+        };
+        if (nested()) {
+            loop();
+        } else {
+            arena().execute(loop);
+        }
+#else
+        int num_threads = nested() ? 1 : threads();
+        Scope scope;
+        RcppParallel::parallelFor(begin, end, worker, grain, num_threads);
+#endif
+    }
+
+    // parallel_for over items of very uneven cost (e.g. the columns of a count matrix, whose sizes span orders of
+    // magnitude). A grain fixed by the item count gives some chunks many times the work of others, and the threads
+    // that are done wait for the one that drew the heaviest chunk. Here the chunks are the cost_ranges(), a range
+    // per task, costliest first: the threads steal the ranges left over as they finish, and the tail of the loop
+    // is at most about one range long, a small share of the work of a thread.
+    template<typename Worker>
+    static void parallel_for_costs(const std::vector<double> &costs, Worker &worker) {
+        if (m_grain > 0) {
+            parallel_for(0, costs.size(), worker, m_grain);
+            return;
+        }
+        std::vector<std::pair<size_t, size_t>> ranges = cost_ranges(costs);
+        RangesWorker<Worker> ranges_worker(ranges, worker);
+        parallel_for(0, ranges.size(), ranges_worker, 1);
+    }
+
+    template<typename Worker>
+    static void parallel_reduce(size_t begin, size_t end, Worker &worker, size_t grain, ParallelAffinity *affinity = nullptr) {
+        if (begin >= end) {
+            return;
+        }
+        if (threads() <= 1) {
+            Scope scope;
+            worker(begin, end);
+            return;
+        }
+#if RCPP_PARALLEL_USE_TBB
+        ReduceBody<Worker> body(worker);
+        auto loop = [&]() {
+            tbb::blocked_range<size_t> range(begin, end, grain);
+            if (affinity != nullptr && m_affinity) {
+                tbb::parallel_reduce(range, body, affinity->partitioner());
+            } else {
+                tbb::parallel_reduce(range, body, tbb::simple_partitioner());
+            }
+        };
+        if (nested()) {
+            loop();
+        } else {
+            arena().execute(loop);
+        }
+#else
+        int num_threads = nested() ? 1 : threads();
+        Scope scope;
+        RcppParallel::parallelReduce(begin, end, worker, grain, num_threads);
+#endif
+    }
+};
+
+#endif //TGLKMEANS_PARALLEL_H
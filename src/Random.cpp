@@ -10,7 +10,7 @@ std::mt19937         Random::m_rng(Random::m_rd());
 Random::Random() {
 }
 
-float Random::fraction() {
+double Random::fraction() {
     std::uniform_real_distribution<> dis(0, 1);
     return (dis(Random::m_rng));
 }
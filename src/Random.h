@@ -6,8 +6,23 @@
 #define TGLKMEANS_RANDOM_H
 
 
+#include <cstddef>
 #include <random>
 
+// Below this many rows, row indices are drawn from float fractions, as they always were, so that the seeds of a given
+// random stream do not change. A float has only 24 bits of precision, so larger inputs draw double fractions (53 bits),
+// which can reach every row.
+static const size_t FLOAT_FRACTION_ROWS = size_t(1) << 24;
+
+// Row index fraction * n (not clamped, fraction may round up to n). Below FLOAT_FRACTION_ROWS the fraction is
+// narrowed to float and the product is computed in float, as it always was.
+inline size_t fraction_to_index(double fraction, size_t n) {
+    if (n < FLOAT_FRACTION_ROWS) {
+        return size_t(float(fraction) * n);
+    }
+    return size_t(fraction * n);
+}
+
 class Random {
 private:
     static std::random_device m_rd;
@@ -17,7 +32,7 @@ public:
 
     static void seed(const int& seed);
 
-    static float fraction();
+    static double fraction();
 
 };
 
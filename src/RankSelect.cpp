@@ -0,0 +1,229 @@
+//
+// Linear time rank selection over per-row distances
+//
+
+#include <algorithm>
+#include <RcppParallel.h>
+#include "RankSelect.h"
+#include "KMeansCenterBase.h"
+#include "Parallel.h"
+
+using namespace std;
+
+static const size_t HISTOGRAM_BINS = 4096;
+
+// Counts the sentinel keys and the range of the other keys
+class KeyRangeWorker : public RcppParallel::Worker {
+public:
+    const vector<float> &keys;
+    size_t n_low;   // -REAL_MAX
+    size_t n_high;  // REAL_MAX
+    float lo;
+    float hi;
+
+    KeyRangeWorker(const vector<float> &keys) : keys(keys), n_low(0), n_high(0), lo(REAL_MAX), hi(-REAL_MAX) {}
+
+    KeyRangeWorker(const KeyRangeWorker &other, RcppParallel::Split) : KeyRangeWorker(other.keys) {}
+
+    void operator()(size_t begin, size_t end) override {
+        for (size_t i = begin; i < end; i++) {
+            float key = keys[i];
+            if (key == -REAL_MAX) {
+                n_low++;
+            } else if (key == REAL_MAX) {
+                n_high++;
+            } else {
+                lo = min(lo, key);
+                hi = max(hi, key);
+            }
+        }
+    }
+
+    void join(const KeyRangeWorker &other) {
+        n_low += other.n_low;
+        n_high += other.n_high;
+        lo = min(lo, other.lo);
+        hi = max(hi, other.hi);
+    }
+};
+
+// Maps the keys in [lo, hi] to bins, monotonically (equal keys share a bin)
+struct KeyBins {
+    double lo;
+    double scale;
+
+    KeyBins(float lo, float hi) : lo(lo), scale(hi > lo ? HISTOGRAM_BINS / (double(hi) - lo) : 0) {}
+
+    size_t operator()(float key) const {
+        return min(HISTOGRAM_BINS - 1, size_t((key - lo) * scale));
+    }
+};
+
+class HistogramWorker : public RcppParallel::Worker {
+public:
+    const vector<float> &keys;
+    KeyBins bins;
+    vector<size_t> counts;
+
+    HistogramWorker(const vector<float> &keys, const KeyBins &bins) : keys(keys), bins(bins), counts(HISTOGRAM_BINS, 0) {}
+
+    HistogramWorker(const HistogramWorker &other, RcppParallel::Split) : HistogramWorker(other.keys, other.bins) {}
+
+    void operator()(size_t begin, size_t end) override {
+        for (size_t i = begin; i < end; i++) {
+            float key = keys[i];
+            if (key != -REAL_MAX && key != REAL_MAX) {
+                counts[bins(key)]++;
+            }
+        }
+    }
+
+    void join(const HistogramWorker &other) {
+        for (size_t b = 0; b < HISTOGRAM_BINS; b++) {
+            counts[b] += other.counts[b];
+        }
+    }
+};
+
+// Collects the rows whose key is exactly key (a sentinel), or in bin [bin_begin, bin_end) otherwise
+class CollectWorker : public RcppParallel::Worker {
+public:
+    const vector<float> &keys;
+    KeyBins bins;
+    float key;
+    size_t bin_begin;
+    size_t bin_end;
+    vector<size_t> rows;
+
+    CollectWorker(const vector<float> &keys, const KeyBins &bins, float key, size_t bin_begin, size_t bin_end)
+        : keys(keys), bins(bins), key(key), bin_begin(bin_begin), bin_end(bin_end) {}
+
+    CollectWorker(const CollectWorker &other, RcppParallel::Split)
+        : CollectWorker(other.keys, other.bins, other.key, other.bin_begin, other.bin_end) {}
+
+    void operator()(size_t begin, size_t end) override {
+        for (size_t i = begin; i < end; i++) {
+            float k = keys[i];
+            if (key == -REAL_MAX || key == REAL_MAX) {
+                if (k == key) {
+                    rows.push_back(i);
+                }
+            } else if (k != -REAL_MAX && k != REAL_MAX) {
+                size_t b = bins(k);
+                if (b >= bin_begin && b < bin_end) {
+                    rows.push_back(i);
+                }
+            }
+        }
+    }
+
+    void join(const CollectWorker &other) {
+        rows.insert(rows.end(), other.rows.begin(), other.rows.end());
+    }
+};
+
+// The selection passes read a key or two per row
+static size_t key_grain(size_t n) {
+    return Parallel::grain(n, 4);
+}
+
+// Collects the rows of the bins holding ranks [first_rank, last_rank] among the non sentinel keys, and sets
+// rank_offset to the number of such rows in the bins before them
+static void collect_ranks(const vector<float> &keys, const KeyRangeWorker &range, size_t first_rank, size_t last_rank,
+                          vector<size_t> &rows, size_t &rank_offset) {
+    KeyBins bins(range.lo, range.hi);
+    HistogramWorker histogram(keys, bins);
+    Parallel::parallel_reduce(0, keys.size(), histogram, key_grain(keys.size()));
+
+    size_t cum = 0;
+    size_t bin_begin = 0;
+    while (cum + histogram.counts[bin_begin] <= first_rank) {
+        cum += histogram.counts[bin_begin];
+        bin_begin++;
+    }
+    rank_offset = cum;
+    size_t bin_end = bin_begin;
+    while (cum <= last_rank) {
+        cum += histogram.counts[bin_end];
+        bin_end++;
+    }
+
+    CollectWorker collect(keys, bins, 0, bin_begin, bin_end);
+    Parallel::parallel_reduce(0, keys.size(), collect, key_grain(keys.size()));
+    rows.swap(collect.rows);
+}
+
+// Collects the rows of a sentinel key
+static void collect_key(const vector<float> &keys, float key, vector<size_t> &rows) {
+    CollectWorker collect(keys, KeyBins(0, 0), key, 0, 0);
+    Parallel::parallel_reduce(0, keys.size(), collect, key_grain(keys.size()));
+    rows.swap(collect.rows);
+}
+
+static bool by_key(const vector<float> &keys, size_t a, size_t b) {
+    return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+}
+
+size_t select_rank(const vector<float> &keys, size_t rank) {
+    KeyRangeWorker range(keys);
+    Parallel::parallel_reduce(0, keys.size(), range, key_grain(keys.size()));
+
+    vector<size_t> rows;
+    if (rank < range.n_low) {
+        // The rows of a sentinel are ordered by row
+        collect_key(keys, -REAL_MAX, rows);
+    } else if (rank >= keys.size() - range.n_high) {
+        collect_key(keys, REAL_MAX, rows);
+        rank -= keys.size() - range.n_high;
+    } else {
+        size_t offset;
+        rank -= range.n_low;
+        collect_ranks(keys, range, rank, rank, rows, offset);
+        rank -= offset;
+    }
+    nth_element(rows.begin(), rows.begin() + rank, rows.end(), [&](size_t a, size_t b) { return by_key(keys, a, b); });
+    return rows[rank];
+}
+
+void select_smallest(const vector<float> &keys, size_t m, vector<size_t> &rows) {
+    rows.clear();
+    KeyRangeWorker range(keys);
+    Parallel::parallel_reduce(0, keys.size(), range, key_grain(keys.size()));
+
+    m = min(m, keys.size() - range.n_low - range.n_high);
+    if (m == 0) {
+        return;
+    }
+    // Rows of the bins up to the one holding rank m - 1
+    size_t offset;
+    collect_ranks(keys, range, 0, m - 1, rows, offset);
+    partial_sort(rows.begin(), rows.begin() + m, rows.end(), [&](size_t a, size_t b) { return by_key(keys, a, b); });
+    rows.resize(m);
+}
+
+class CountWorker : public RcppParallel::Worker {
+public:
+    const vector<float> &keys;
+    float key;
+    size_t count;
+
+    CountWorker(const vector<float> &keys, float key) : keys(keys), key(key), count(0) {}
+
+    CountWorker(const CountWorker &other, RcppParallel::Split) : CountWorker(other.keys, other.key) {}
+
+    void operator()(size_t begin, size_t end) override {
+        for (size_t i = begin; i < end; i++) {
+            count += keys[i] == key;
+        }
+    }
+
+    void join(const CountWorker &other) {
+        count += other.count;
+    }
+};
+
+size_t count_key(const vector<float> &keys, float key) {
+    CountWorker worker(keys, key);
+    Parallel::parallel_reduce(0, keys.size(), worker, key_grain(keys.size()));
+    return worker.count;
+}
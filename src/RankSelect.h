@@ -0,0 +1,26 @@
+//
+// Linear time rank selection over per-row distances
+//
+
+#ifndef TGLKMEANS_RANKSELECT_H
+#define TGLKMEANS_RANKSELECT_H
+
+#include <cstddef>
+#include <vector>
+
+// Rows are ordered by (keys[row], row), the order of sorting (distance, row) pairs. The selection
+// buckets the keys in a parallel histogram pass, and only the rows of the bucket holding the
+// requested rank are collected and partitioned, so nothing is copied or sorted in full.
+// -REAL_MAX and REAL_MAX (assigned / missing markers) are counted apart from the histogram range.
+
+// Returns the row of the given rank (0 based, rank < keys.size())
+size_t select_rank(const std::vector<float> &keys, size_t rank);
+
+// Sets rows to the m rows of lowest rank, in rank order, among the rows whose key is not a sentinel
+// (fewer if there are not enough such rows)
+void select_smallest(const std::vector<float> &keys, size_t m, std::vector<size_t> &rows);
+
+// Number of rows with keys[row] == key
+size_t count_key(const std::vector<float> &keys, float key);
+
+#endif //TGLKMEANS_RANKSELECT_H
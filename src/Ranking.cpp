@@ -4,12 +4,12 @@
 
 using namespace std;
 
-void mid_ranking(vector<float> &ranks, const list<int> &order, 
+void mid_ranking(vector<float> &ranks, const vector<int> &order, 
 						const vector<float> &vals)
 {
 	float count = 1;
 	float ecount = 0;
-	list<int>::const_iterator i = order.begin(); 
+	vector<int>::const_iterator i = order.begin(); 
 	while(i != order.end() && vals[*i] == -REAL_MAX) {
 		ranks[*i] = -REAL_MAX;
 		i++;
@@ -28,7 +28,7 @@ void mid_ranking(vector<float> &ranks, const list<int> &order,
 		if(val != prev_val) {
 			if(ecount > 1) {
 				float mean_count = count + (ecount-1)/2;
-				list<int>::const_iterator j = i;
+				vector<int>::const_iterator j = i;
 				for(int k = 0; k < ecount; k++) {
 					do {
 						j--;
@@ -48,7 +48,7 @@ void mid_ranking(vector<float> &ranks, const list<int> &order,
 	}
 	if(ecount > 1) {
 		float mean_count = count + (ecount-1)/2;
-		list<int>::const_reverse_iterator j = order.rbegin();
+		vector<int>::const_reverse_iterator j = order.rbegin();
 		while(vals[*j] == -REAL_MAX) {
 			j++;
 		}
@@ -63,12 +63,12 @@ void mid_ranking(vector<float> &ranks, const list<int> &order,
 	}
 }
 void cond_mid_ranking(vector<float> &ranks, 
-		const list<int> &order, const 
+		const vector<int> &order, const 
 		vector<float> &vals, const vector<float> &noz_vals) 
 {
 	float count = 1;
 	float ecount = 0;
-	list<int>::const_iterator i = order.begin(); 
+	vector<int>::const_iterator i = order.begin(); 
 	while(i != order.end()
 	&& (vals[*i] == -REAL_MAX || noz_vals[*i] == -REAL_MAX)) {
 		ranks[*i] = -REAL_MAX;
@@ -88,7 +88,7 @@ void cond_mid_ranking(vector<float> &ranks,
 		if(val != prev_val) {
 			if(ecount > 1) {
 				float mean_count = count + (ecount-1)/2;
-				list<int>::const_iterator j = i;
+				vector<int>::const_iterator j = i;
 				for(int k = 0; k < ecount; k++) {
 					do {
 						j--;
@@ -109,7 +109,7 @@ void cond_mid_ranking(vector<float> &ranks,
 	}
 	if(ecount > 1) {
 		float mean_count = count + (ecount-1)/2;
-		list<int>::const_reverse_iterator j = order.rbegin();
+		vector<int>::const_reverse_iterator j = order.rbegin();
 		while(vals[*j] == -REAL_MAX || noz_vals[*j] == -REAL_MAX) {
 			j++;
 		}
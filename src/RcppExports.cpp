@@ -33,9 +33,23 @@ BEGIN_RCPP
     return R_NilValue;
 END_RCPP
 }
+// coclust_matrix_cpp
+SEXP coclust_matrix_cpp(const List& boot_nodes_l, const List& cc_ij_mat_l, int n, double threshold);
+RcppExport SEXP _tglkmeans_coclust_matrix_cpp(SEXP boot_nodes_lSEXP, SEXP cc_ij_mat_lSEXP, SEXP nSEXP, SEXP thresholdSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const List& >::type boot_nodes_l(boot_nodes_lSEXP);
+    Rcpp::traits::input_parameter< const List& >::type cc_ij_mat_l(cc_ij_mat_lSEXP);
+    Rcpp::traits::input_parameter< int >::type n(nSEXP);
+    Rcpp::traits::input_parameter< double >::type threshold(thresholdSEXP);
+    rcpp_result_gen = Rcpp::wrap(coclust_matrix_cpp(boot_nodes_l, cc_ij_mat_l, n, threshold));
+    return rcpp_result_gen;
+END_RCPP
+}
 // TGL_kmeans_cpp
-List TGL_kmeans_cpp(const StringVector& ids, DataFrame& mat, const int& k, const String& metric, const double& max_iter, const double& min_delta, const bool& use_cpp_random, const int& seed);
-RcppExport SEXP _tglkmeans_TGL_kmeans_cpp(SEXP idsSEXP, SEXP matSEXP, SEXP kSEXP, SEXP metricSEXP, SEXP max_iterSEXP, SEXP min_deltaSEXP, SEXP use_cpp_randomSEXP, SEXP seedSEXP) {
+List TGL_kmeans_cpp(const StringVector& ids, DataFrame& mat, const int& k, const String& metric, const double& max_iter, const double& min_delta, const bool& use_cpp_random, const int& seed, const double& coreset_size, const String& data_precision, const bool& hierarchical, const int& refine_iter, const double& time_limit, const bool& margins);
+RcppExport SEXP _tglkmeans_TGL_kmeans_cpp(SEXP idsSEXP, SEXP matSEXP, SEXP kSEXP, SEXP metricSEXP, SEXP max_iterSEXP, SEXP min_deltaSEXP, SEXP use_cpp_randomSEXP, SEXP seedSEXP, SEXP coreset_sizeSEXP, SEXP data_precisionSEXP, SEXP hierarchicalSEXP, SEXP refine_iterSEXP, SEXP time_limitSEXP, SEXP marginsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -47,33 +61,163 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const double& >::type min_delta(min_deltaSEXP);
     Rcpp::traits::input_parameter< const bool& >::type use_cpp_random(use_cpp_randomSEXP);
     Rcpp::traits::input_parameter< const int& >::type seed(seedSEXP);
-    rcpp_result_gen = Rcpp::wrap(TGL_kmeans_cpp(ids, mat, k, metric, max_iter, min_delta, use_cpp_random, seed));
+    Rcpp::traits::input_parameter< const double& >::type coreset_size(coreset_sizeSEXP);
+    Rcpp::traits::input_parameter< const String& >::type data_precision(data_precisionSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type hierarchical(hierarchicalSEXP);
+    Rcpp::traits::input_parameter< const int& >::type refine_iter(refine_iterSEXP);
+    Rcpp::traits::input_parameter< const double& >::type time_limit(time_limitSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type margins(marginsSEXP);
+    rcpp_result_gen = Rcpp::wrap(TGL_kmeans_cpp(ids, mat, k, metric, max_iter, min_delta, use_cpp_random, seed, coreset_size, data_precision, hierarchical, refine_iter, time_limit, margins));
+    return rcpp_result_gen;
+END_RCPP
+}
+// TGL_kmeans_sweep_cpp
+List TGL_kmeans_sweep_cpp(DataFrame& mat, const IntegerVector& ks, const String& metric, const double& max_iter, const double& min_delta, const bool& use_cpp_random, const int& seed, const String& data_precision, const double& time_limit);
+RcppExport SEXP _tglkmeans_TGL_kmeans_sweep_cpp(SEXP matSEXP, SEXP ksSEXP, SEXP metricSEXP, SEXP max_iterSEXP, SEXP min_deltaSEXP, SEXP use_cpp_randomSEXP, SEXP seedSEXP, SEXP data_precisionSEXP, SEXP time_limitSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< DataFrame& >::type mat(matSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type ks(ksSEXP);
+    Rcpp::traits::input_parameter< const String& >::type metric(metricSEXP);
+    Rcpp::traits::input_parameter< const double& >::type max_iter(max_iterSEXP);
+    Rcpp::traits::input_parameter< const double& >::type min_delta(min_deltaSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type use_cpp_random(use_cpp_randomSEXP);
+    Rcpp::traits::input_parameter< const int& >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< const String& >::type data_precision(data_precisionSEXP);
+    Rcpp::traits::input_parameter< const double& >::type time_limit(time_limitSEXP);
+    rcpp_result_gen = Rcpp::wrap(TGL_kmeans_sweep_cpp(mat, ks, metric, max_iter, min_delta, use_cpp_random, seed, data_precision, time_limit));
+    return rcpp_result_gen;
+END_RCPP
+}
+// predict_kmeans_cpp
+IntegerVector predict_kmeans_cpp(DataFrame& mat, DataFrame& centers_mat, const String& metric);
+RcppExport SEXP _tglkmeans_predict_kmeans_cpp(SEXP matSEXP, SEXP centers_matSEXP, SEXP metricSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< DataFrame& >::type mat(matSEXP);
+    Rcpp::traits::input_parameter< DataFrame& >::type centers_mat(centers_matSEXP);
+    Rcpp::traits::input_parameter< const String& >::type metric(metricSEXP);
+    rcpp_result_gen = Rcpp::wrap(predict_kmeans_cpp(mat, centers_mat, metric));
+    return rcpp_result_gen;
+END_RCPP
+}
+// cluster_quality_cpp
+List cluster_quality_cpp(DataFrame& mat, DataFrame& centers_mat, const IntegerVector& assignment, const String& metric, const NumericVector& sample);
+RcppExport SEXP _tglkmeans_cluster_quality_cpp(SEXP matSEXP, SEXP centers_matSEXP, SEXP assignmentSEXP, SEXP metricSEXP, SEXP sampleSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< DataFrame& >::type mat(matSEXP);
+    Rcpp::traits::input_parameter< DataFrame& >::type centers_mat(centers_matSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type assignment(assignmentSEXP);
+    Rcpp::traits::input_parameter< const String& >::type metric(metricSEXP);
+    Rcpp::traits::input_parameter< const NumericVector& >::type sample(sampleSEXP);
+    rcpp_result_gen = Rcpp::wrap(cluster_quality_cpp(mat, centers_mat, assignment, metric, sample));
+    return rcpp_result_gen;
+END_RCPP
+}
+// set_parallel_cpp
+void set_parallel_cpp(const int& max_threads, const int& r_workers, const double& grain_size, const bool& affinity);
+RcppExport SEXP _tglkmeans_set_parallel_cpp(SEXP max_threadsSEXP, SEXP r_workersSEXP, SEXP grain_sizeSEXP, SEXP affinitySEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const int& >::type max_threads(max_threadsSEXP);
+    Rcpp::traits::input_parameter< const int& >::type r_workers(r_workersSEXP);
+    Rcpp::traits::input_parameter< const double& >::type grain_size(grain_sizeSEXP);
+    Rcpp::traits::input_parameter< const bool& >::type affinity(affinitySEXP);
+    set_parallel_cpp(max_threads, r_workers, grain_size, affinity);
+    return R_NilValue;
+END_RCPP
+}
+// get_parallel_cpp
+List get_parallel_cpp();
+RcppExport SEXP _tglkmeans_get_parallel_cpp() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    rcpp_result_gen = Rcpp::wrap(get_parallel_cpp());
     return rcpp_result_gen;
 END_RCPP
 }
 // downsample_matrix_cpp
-Rcpp::IntegerMatrix downsample_matrix_cpp(Rcpp::IntegerMatrix input, int samples, unsigned int random_seed);
-RcppExport SEXP _tglkmeans_downsample_matrix_cpp(SEXP inputSEXP, SEXP samplesSEXP, SEXP random_seedSEXP) {
+Rcpp::List downsample_matrix_cpp(SEXP input, int samples, unsigned int random_seed, const std::string &method);
+RcppExport SEXP _tglkmeans_downsample_matrix_cpp(SEXP inputSEXP, SEXP samplesSEXP, SEXP random_seedSEXP, SEXP methodSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< Rcpp::IntegerMatrix >::type input(inputSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type input(inputSEXP);
     Rcpp::traits::input_parameter< int >::type samples(samplesSEXP);
     Rcpp::traits::input_parameter< unsigned int >::type random_seed(random_seedSEXP);
-    rcpp_result_gen = Rcpp::wrap(downsample_matrix_cpp(input, samples, random_seed));
+    Rcpp::traits::input_parameter< const std::string& >::type method(methodSEXP);
+    rcpp_result_gen = Rcpp::wrap(downsample_matrix_cpp(input, samples, random_seed, method));
     return rcpp_result_gen;
 END_RCPP
 }
 // rcpp_downsample_sparse
-Rcpp::S4 rcpp_downsample_sparse(Rcpp::S4 matrix, int samples, unsigned int random_seed);
-RcppExport SEXP _tglkmeans_rcpp_downsample_sparse(SEXP matrixSEXP, SEXP samplesSEXP, SEXP random_seedSEXP) {
+Rcpp::List rcpp_downsample_sparse(Rcpp::S4 matrix, int samples, unsigned int random_seed, const std::string &method);
+RcppExport SEXP _tglkmeans_rcpp_downsample_sparse(SEXP matrixSEXP, SEXP samplesSEXP, SEXP random_seedSEXP, SEXP methodSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::S4 >::type matrix(matrixSEXP);
     Rcpp::traits::input_parameter< int >::type samples(samplesSEXP);
     Rcpp::traits::input_parameter< unsigned int >::type random_seed(random_seedSEXP);
-    rcpp_result_gen = Rcpp::wrap(rcpp_downsample_sparse(matrix, samples, random_seed));
+    Rcpp::traits::input_parameter< const std::string& >::type method(methodSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_downsample_sparse(matrix, samples, random_seed, method));
+    return rcpp_result_gen;
+END_RCPP
+}
+// downsample_matrix_multi_cpp
+Rcpp::List downsample_matrix_multi_cpp(SEXP input, Rcpp::IntegerMatrix targets, unsigned int random_seed, const std::string &method);
+RcppExport SEXP _tglkmeans_downsample_matrix_multi_cpp(SEXP inputSEXP, SEXP targetsSEXP, SEXP random_seedSEXP, SEXP methodSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type input(inputSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerMatrix >::type targets(targetsSEXP);
+    Rcpp::traits::input_parameter< unsigned int >::type random_seed(random_seedSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type method(methodSEXP);
+    rcpp_result_gen = Rcpp::wrap(downsample_matrix_multi_cpp(input, targets, random_seed, method));
+    return rcpp_result_gen;
+END_RCPP
+}
+// downsample_csc_file_cpp
+Rcpp::NumericVector downsample_csc_file_cpp(std::string input_path, std::string output_path, int samples, unsigned int random_seed, const std::string &method, double block_nnz);
+RcppExport SEXP _tglkmeans_downsample_csc_file_cpp(SEXP input_pathSEXP, SEXP output_pathSEXP, SEXP samplesSEXP, SEXP random_seedSEXP, SEXP methodSEXP, SEXP block_nnzSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type input_path(input_pathSEXP);
+    Rcpp::traits::input_parameter< std::string >::type output_path(output_pathSEXP);
+    Rcpp::traits::input_parameter< int >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< unsigned int >::type random_seed(random_seedSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type method(methodSEXP);
+    Rcpp::traits::input_parameter< double >::type block_nnz(block_nnzSEXP);
+    rcpp_result_gen = Rcpp::wrap(downsample_csc_file_cpp(input_path, output_path, samples, random_seed, method, block_nnz));
+    return rcpp_result_gen;
+END_RCPP
+}
+// write_csc_file_cpp
+void write_csc_file_cpp(Rcpp::S4 matrix, std::string path);
+RcppExport SEXP _tglkmeans_write_csc_file_cpp(SEXP matrixSEXP, SEXP pathSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::S4 >::type matrix(matrixSEXP);
+    Rcpp::traits::input_parameter< std::string >::type path(pathSEXP);
+    write_csc_file_cpp(matrix, path);
+    return R_NilValue;
+END_RCPP
+}
+// read_csc_file_cpp
+Rcpp::S4 read_csc_file_cpp(std::string path);
+RcppExport SEXP _tglkmeans_read_csc_file_cpp(SEXP pathSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type path(pathSEXP);
+    rcpp_result_gen = Rcpp::wrap(read_csc_file_cpp(path));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -81,9 +225,19 @@ END_RCPP
 static const R_CallMethodDef CallEntries[] = {
     {"_tglkmeans_reduce_coclust", (DL_FUNC) &_tglkmeans_reduce_coclust, 3},
     {"_tglkmeans_reduce_num_trials", (DL_FUNC) &_tglkmeans_reduce_num_trials, 2},
-    {"_tglkmeans_TGL_kmeans_cpp", (DL_FUNC) &_tglkmeans_TGL_kmeans_cpp, 8},
-    {"_tglkmeans_downsample_matrix_cpp", (DL_FUNC) &_tglkmeans_downsample_matrix_cpp, 3},
-    {"_tglkmeans_rcpp_downsample_sparse", (DL_FUNC) &_tglkmeans_rcpp_downsample_sparse, 3},
+    {"_tglkmeans_coclust_matrix_cpp", (DL_FUNC) &_tglkmeans_coclust_matrix_cpp, 4},
+    {"_tglkmeans_TGL_kmeans_cpp", (DL_FUNC) &_tglkmeans_TGL_kmeans_cpp, 14},
+    {"_tglkmeans_TGL_kmeans_sweep_cpp", (DL_FUNC) &_tglkmeans_TGL_kmeans_sweep_cpp, 9},
+    {"_tglkmeans_predict_kmeans_cpp", (DL_FUNC) &_tglkmeans_predict_kmeans_cpp, 3},
+    {"_tglkmeans_cluster_quality_cpp", (DL_FUNC) &_tglkmeans_cluster_quality_cpp, 5},
+    {"_tglkmeans_set_parallel_cpp", (DL_FUNC) &_tglkmeans_set_parallel_cpp, 4},
+    {"_tglkmeans_get_parallel_cpp", (DL_FUNC) &_tglkmeans_get_parallel_cpp, 0},
+    {"_tglkmeans_downsample_matrix_cpp", (DL_FUNC) &_tglkmeans_downsample_matrix_cpp, 4},
+    {"_tglkmeans_rcpp_downsample_sparse", (DL_FUNC) &_tglkmeans_rcpp_downsample_sparse, 4},
+    {"_tglkmeans_downsample_matrix_multi_cpp", (DL_FUNC) &_tglkmeans_downsample_matrix_multi_cpp, 4},
+    {"_tglkmeans_downsample_csc_file_cpp", (DL_FUNC) &_tglkmeans_downsample_csc_file_cpp, 6},
+    {"_tglkmeans_write_csc_file_cpp", (DL_FUNC) &_tglkmeans_write_csc_file_cpp, 2},
+    {"_tglkmeans_read_csc_file_cpp", (DL_FUNC) &_tglkmeans_read_csc_file_cpp, 1},
     {NULL, NULL, 0}
 };
 
@@ -1,39 +1,49 @@
 #include "ReassignWorker.h"
+#include "VoteWorker.h"
+#include "Parallel.h"
+#include "Scratch.h"
 
 // Primary constructor
-ReassignWorker::ReassignWorker(const std::vector<std::vector<float>>& data,
+ReassignWorker::ReassignWorker(const KMeansData& data,
                                std::vector<KMeansCenterBase*>& centers,
-                               std::vector<int>& assignment)
-    : data(data), centers(centers), assignment(assignment) {
-    votes.resize(centers.size());
-    for (auto& v : votes) {
-        v.resize(data.size(), 0);
-    }
-    changes.resize(data.size(), 0);
-}
+                               std::vector<int>& assignment,
+                               const std::vector<float>& weights,
+                               const KMeansCenterIndex* index,
+                               const CancellationToken* token,
+                               AssignmentMargins* margins)
+    : data(data), centers(centers), assignment(assignment), weights(weights), index(index), token(token), margins(margins), changes(0) {}
 
 // Split constructor for parallelReduce
-// Creates a new worker with its own vote/change storage that will be merged later
 ReassignWorker::ReassignWorker(const ReassignWorker& other, RcppParallel::Split)
-    : data(other.data), centers(other.centers), assignment(other.assignment) {
-    votes.resize(centers.size());
-    for (auto& v : votes) {
-        v.resize(data.size(), 0);
-    }
-    changes.resize(data.size(), 0);
-}
+    : data(other.data), centers(other.centers), assignment(other.assignment), weights(other.weights), index(other.index), token(other.token), margins(other.margins), changes(0) {}
 
 void ReassignWorker::operator()(std::size_t begin, std::size_t end) {
+    ScratchVector<float> scratch;
+    std::vector<float> &buf = *scratch;
     for (std::size_t i = begin; i < end; i++) {
+        if (token && token->cancelled()) {
+            return;
+        }
         int best_id_i = -1;
         float best_dist = std::numeric_limits<float>::max();
 
-        // Determine the closest center
-        for (size_t j = 0; j < centers.size(); j++) {
-            float dist = centers[j]->dist(data[i]);
-            if (dist < best_dist) {
-                best_dist = dist;
-                best_id_i = j;
+        // Determine the closest center (the row is decoded once for all the centers)
+        const std::vector<float>& x = data.row(i, buf);
+        const uint64_t* x_na = data.na_mask(i);
+        if (margins) {
+            int second = -1;
+            float second_dist = REAL_MAX;
+            best_id_i = nearest_two(centers, index, x, x_na, best_dist, second, second_dist);
+            margins->set(i, best_dist, second, second_dist);
+        } else if (index) {
+            best_id_i = index->nearest(x, x_na, best_dist);
+        } else {
+            for (size_t j = 0; j < centers.size(); j++) {
+                float dist = centers[j]->dist(x, x_na);
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best_id_i = j;
+                }
             }
         }
 
@@ -42,13 +52,10 @@ void ReassignWorker::operator()(std::size_t begin, std::size_t end) {
             best_id_i = 0;
         }
 
-        // Accumulate vote
-        votes[best_id_i][i] = 1;
-
         // Track changes in assignments
         if (assignment[i] != best_id_i) {
             assignment[i] = best_id_i;
-            changes[i]++;
+            changes++;
         }
     }
 }
@@ -56,26 +63,25 @@ void ReassignWorker::operator()(std::size_t begin, std::size_t end) {
 // Join results from another worker into this one
 // Called by parallelReduce to merge results from different chunks
 void ReassignWorker::join(const ReassignWorker& other) {
-    // Merge votes: since each data point is processed by exactly one chunk,
-    // we can simply add the votes (one will be 0, the other will be 0 or 1)
-    for (size_t i = 0; i < votes.size(); i++) {
-        for (size_t j = 0; j < votes[i].size(); j++) {
-            votes[i][j] += other.votes[i][j];
-        }
-    }
-    
-    // Merge change counts
-    for (size_t i = 0; i < changes.size(); i++) {
-        changes[i] += other.changes[i];
-    }
+    changes += other.changes;
 }
 
 void ReassignWorker::apply_votes() {
+    // Bucket the rows by center (in ascending row order, so every center sums its votes
+    // in the same order as voting the rows one by one)
+    std::vector<size_t> offsets(centers.size() + 1, 0);
+    for (int clust : assignment) {
+        offsets[clust + 1]++;   // the assignment is complete, see KMeans::reassign
+    }
     for (size_t i = 0; i < centers.size(); i++) {
-        for (size_t j = 0; j < data.size(); j++) {
-            if (votes[i][j] > 0) {
-                centers[i]->vote(data[j], votes[i][j]);
-            }
-        }
+        offsets[i + 1] += offsets[i];
+    }
+    std::vector<size_t> rows(assignment.size());
+    std::vector<size_t> pos(offsets.begin(), offsets.end() - 1);
+    for (size_t j = 0; j < assignment.size(); j++) {
+        rows[pos[assignment[j]]++] = j;
     }
+
+    VoteWorker worker(data, centers, rows, offsets, weights);
+    Parallel::parallel_for(0, worker.tasks(), worker, 1);
 }
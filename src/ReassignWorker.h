@@ -3,25 +3,36 @@
 
 #include <RcppParallel.h>
 #include "KMeansCenterBase.h"
+#include "KMeansData.h"
+#include "KMeansCenterIndex.h"
+#include "Cancellation.h"
+#include "AssignmentMargins.h"
 #include <vector>
-#include <numeric>
 
-// ReassignWorker uses parallelReduce to safely accumulate votes across threads.
-// Each thread chunk gets its own copy via the split constructor, and results
-// are merged via join() after parallel execution completes.
+// ReassignWorker uses parallelReduce to count the changed assignments across threads.
+// Each row is written by exactly one chunk, so the assignment is updated in place and
+// only the change counts are merged via join(). The votes of the new assignment are
+// applied afterwards by apply_votes().
 class ReassignWorker : public RcppParallel::Worker {
 private:
-    const std::vector<std::vector<float>>& data;
+    const KMeansData& data;
     std::vector<KMeansCenterBase*>& centers;
     std::vector<int>& assignment;
-    std::vector<std::vector<float>> votes; // Per-chunk votes, merged via join()
-    std::vector<int> changes; // Per-chunk change tracking, merged via join()
+    const std::vector<float>& weights; // Per-row vote weights (empty means 1)
+    const KMeansCenterIndex* index; // Nearest center index over centers (nullptr means a full scan)
+    const CancellationToken* token; // Rows are skipped once it is cancelled (nullptr means never)
+    AssignmentMargins* margins; // Distances to the new center and the runner up (nullptr means not recorded)
+    size_t changes; // Per-chunk change count, merged via join()
 
 public:
     // Primary constructor
-    ReassignWorker(const std::vector<std::vector<float>>& data,
+    ReassignWorker(const KMeansData& data,
                    std::vector<KMeansCenterBase*>& centers,
-                   std::vector<int>& assignment);
+                   std::vector<int>& assignment,
+                   const std::vector<float>& weights,
+                   const KMeansCenterIndex* index = nullptr,
+                   const CancellationToken* token = nullptr,
+                   AssignmentMargins* margins = nullptr);
 
     // Split constructor for parallelReduce - creates a new worker for a chunk
     ReassignWorker(const ReassignWorker& other, RcppParallel::Split);
@@ -31,11 +42,10 @@ public:
     // Join results from another worker (called by parallelReduce)
     void join(const ReassignWorker& other);
 
+    // Votes every row to its assigned center, in parallel over centers and dimension blocks
     void apply_votes();
 
-    size_t get_changes() const { 
-        return std::accumulate(changes.begin(), changes.end(), 0);
-    }
+    size_t get_changes() const { return changes; }
 };
 
 #endif // REASSIGNWORKER_H
@@ -1,40 +1,306 @@
 // [[Rcpp::plugins("cpp11")]]
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
 #include <Rcpp.h>
+#include <RcppParallel.h>
+#include "Parallel.h"
+#include "Scratch.h"
 
 using namespace Rcpp;
 using namespace std;
 
-void reduce_coclust_single(const NumericVector& boot_nodes, const NumericMatrix& cc_ij_mat, NumericMatrix& cc_mat){
-    for (int i=0; i < boot_nodes.length(); ++i){
-        NumericMatrix::Column cc_col = cc_mat(_, boot_nodes[i] - 1);
-        NumericMatrix::ConstColumn cc_ij_col = cc_ij_mat(_, i);
+// A bootstrap sample: the (0 based) node of every position and the sample's co-clustering matrix. The positions are
+// kept ordered by node, so that the positions of a node (several when sampled with replacement) and those of all
+// the nodes up to it are found by a binary search.
+struct CoclustSample {
+    vector<int> nodes;       // node of every position, in node order
+    vector<int> positions;   // position in the sample, in node order
+    const double *coclust;   // size x size, column major, or nullptr to count the trials
+    size_t size;
+    size_t max_multiplicity; // most positions of a node
+};
 
-        for (int j = 0; j < boot_nodes.length(); ++j){
-            cc_col[boot_nodes[j] - 1] = cc_col[boot_nodes[j] - 1] + cc_ij_col[j];
-        }           
-    }   
+// The bootstrap samples of n nodes, holding their co-clustering matrices (converted to double if needed)
+class CoclustSamples {
+public:
+    vector<CoclustSample> samples;
+    vector<NumericMatrix> matrices;
+    int n;
+
+    // cc_ij_mat_l is nullptr when only the trials are counted
+    CoclustSamples(const List &boot_nodes_l, const List *cc_ij_mat_l, int n) : samples(boot_nodes_l.length()), n(n) {
+        if (cc_ij_mat_l != nullptr && cc_ij_mat_l->length() != boot_nodes_l.length()) {
+            Rcpp::stop("the number of co-clustering matrices differs from the number of bootstrap samples");
+        }
+        for (int b = 0; b < boot_nodes_l.length(); ++b) {
+            NumericVector boot_nodes = Rcpp::as<NumericVector>(boot_nodes_l[b]);
+            CoclustSample &sample = samples[b];
+            sample.size = boot_nodes.length();
+            sample.nodes.resize(sample.size);
+            for (size_t i = 0; i < sample.size; ++i) {
+                double node = boot_nodes[i];
+                if (!(node >= 1 && node <= n) || node != std::floor(node)) {
+                    Rcpp::stop("bootstrap sample " + to_string(b + 1) + " has nodes outside of 1.." + to_string(n));
+                }
+                sample.nodes[i] = int(node) - 1;
+            }
+            sample.coclust = nullptr;
+            if (cc_ij_mat_l != nullptr) {
+                matrices.push_back(Rcpp::as<NumericMatrix>((*cc_ij_mat_l)[b]));
+                const NumericMatrix &cc_ij_mat = matrices.back();
+                if ((size_t) cc_ij_mat.nrow() != sample.size || (size_t) cc_ij_mat.ncol() != sample.size) {
+                    Rcpp::stop("co-clustering matrix " + to_string(b + 1) + " is not " + to_string(sample.size) + " x " +
+                               to_string(sample.size));
+                }
+                sample.coclust = cc_ij_mat.begin();
+            }
+        }
+
+        // Orders the positions of every sample by node
+        SortWorker sort(samples);
+        Parallel::parallel_for(0, samples.size(), sort, 1);
+    }
+
+    // Sum over the samples of the squared share of the nodes they hold, the share of the pairs of nodes sampled
+    // together in an average sample
+    double density() const {
+        double sum = 0;
+        for (const CoclustSample &sample : samples) {
+            sum += (double(sample.size) / std::max(n, 1)) * (double(sample.size) / std::max(n, 1));
+        }
+        return sum;
+    }
+
+    // Largest count of a pair of nodes (with co-clustering values of 0 and 1)
+    double max_count() const {
+        double count = 0;
+        for (const CoclustSample &sample : samples) {
+            count += double(sample.max_multiplicity) * sample.max_multiplicity;
+        }
+        return count;
+    }
+
+private:
+    class SortWorker : public RcppParallel::Worker {
+    public:
+        vector<CoclustSample> &samples;
+
+        SortWorker(vector<CoclustSample> &samples) : samples(samples) {}
+
+        void operator()(size_t begin, size_t end) override {
+            for (size_t b = begin; b < end; ++b) {
+                CoclustSample &sample = samples[b];
+                sample.positions.resize(sample.size);
+                for (size_t i = 0; i < sample.size; ++i) {
+                    sample.positions[i] = i;
+                }
+                // Stable, so that the sums are taken in the order of the positions as before
+                const vector<int> &nodes = sample.nodes;
+                std::stable_sort(sample.positions.begin(), sample.positions.end(),
+                                 [&](int a, int b) { return nodes[a] < nodes[b]; });
+                vector<int> sorted(sample.size);
+                sample.max_multiplicity = 0;
+                size_t run = 0;
+                for (size_t i = 0; i < sample.size; ++i) {
+                    sorted[i] = nodes[sample.positions[i]];
+                    run = (i > 0 && sorted[i] == sorted[i - 1]) ? run + 1 : 1;
+                    sample.max_multiplicity = std::max(sample.max_multiplicity, run);
+                }
+                sample.nodes.swap(sorted);
+            }
+        }
+    };
+};
+
+// Adds to column col (of a matrix over the nodes) the co-clustering of every position of node col in a sample with
+// every position of the nodes below rows_end, or 1 per such pair when the sample has no co-clustering matrix.
+// trials (optional) gets 1 per pair.
+template<typename O, typename T>
+static void add_coclust_column(const CoclustSample &sample, int col, int rows_end, O *column, T *trials) {
+    auto group = std::equal_range(sample.nodes.begin(), sample.nodes.end(), col);
+    if (group.first == group.second) {
+        return;
+    }
+    size_t end = std::lower_bound(sample.nodes.begin(), sample.nodes.end(), rows_end) - sample.nodes.begin();
+    for (auto it = group.first; it != group.second; ++it) {
+        int position = sample.positions[it - sample.nodes.begin()];
+        if (sample.coclust == nullptr) {
+            for (size_t s = 0; s < end; ++s) {
+                column[sample.nodes[s]] += 1;
+            }
+            continue;
+        }
+        const double *coclust = sample.coclust + size_t(position) * sample.size;
+        for (size_t s = 0; s < end; ++s) {
+            column[sample.nodes[s]] += O(coclust[sample.positions[s]]);
+        }
+        if (trials != nullptr) {
+            for (size_t s = 0; s < end; ++s) {
+                trials[sample.nodes[s]] += 1;
+            }
+        }
+    }
 }
 
-// [[Rcpp::export]]
-void reduce_coclust(const List& boot_nodes_l, const List& cc_ij_mat_l, NumericMatrix& cc_mat){
-    for (int i=0; i < boot_nodes_l.length(); ++i){
-        reduce_coclust_single(Rcpp::as<const Rcpp::NumericVector>(boot_nodes_l[i]), Rcpp::as<const Rcpp::NumericMatrix>(cc_ij_mat_l[i]), cc_mat);
+// Adds the samples to the columns of a dense n x n matrix in place. A thread owns the columns of its chunk, so the
+// columns are written without conflicts.
+class ReduceCoclustWorker : public RcppParallel::Worker {
+private:
+    const CoclustSamples &samples;
+    double *cc_mat;
+
+public:
+    ReduceCoclustWorker(const CoclustSamples &samples, NumericMatrix &cc_mat) : samples(samples), cc_mat(cc_mat.begin()) {}
+
+    void operator()(size_t begin, size_t end) override {
+        for (size_t col = begin; col < end; ++col) {
+            double *column = cc_mat + col * samples.n;
+            for (const CoclustSample &sample : samples.samples) {
+                add_coclust_column(sample, col, samples.n, column, static_cast<uint32_t *>(nullptr));
+            }
+        }
     }
+};
+
+// Computes the upper triangle of the co-clustering fraction (times co-clustered / times sampled together) a column
+// at a time, counting into per-thread counters of type T, so the counts never take more than a column per thread.
+// Writes the packed triangle (packed, NA for pairs never sampled together) or, for sparse output, the rows and
+// fractions of the pairs whose fraction is at least threshold (and above 0) in every column.
+template<typename T>
+class CoclustFractionWorker : public RcppParallel::Worker {
+private:
+    const CoclustSamples &samples;
+    double *packed;
+    double threshold;
+    vector<vector<int>> &sparse_rows;
+    vector<vector<double>> &sparse_x;
+
+public:
+    CoclustFractionWorker(const CoclustSamples &samples, double *packed, double threshold, vector<vector<int>> &sparse_rows,
+                          vector<vector<double>> &sparse_x)
+        : samples(samples), packed(packed), threshold(threshold), sparse_rows(sparse_rows), sparse_x(sparse_x) {}
+
+    void operator()(size_t begin, size_t end) override {
+        ScratchVector<T> coclust;
+        ScratchVector<T> trials;
+        for (size_t col = begin; col < end; ++col) {
+            coclust->assign(col + 1, 0);
+            trials->assign(col + 1, 0);
+            for (const CoclustSample &sample : samples.samples) {
+                add_coclust_column(sample, col, col + 1, coclust->data(), trials->data());
+            }
+
+            if (packed != nullptr) {
+                double *column = packed + col * (col + 1) / 2;
+                for (size_t row = 0; row <= col; ++row) {
+                    column[row] = (*trials)[row] > 0 ? double((*coclust)[row]) / (*trials)[row] : NA_REAL;
+                }
+                continue;
+            }
+            for (size_t row = 0; row <= col; ++row) {
+                if ((*coclust)[row] > 0 && double((*coclust)[row]) / (*trials)[row] >= threshold) {
+                    sparse_rows[col].push_back(row);
+                    sparse_x[col].push_back(double((*coclust)[row]) / (*trials)[row]);
+                }
+            }
+        }
+    }
+};
+
+template<typename T>
+static void coclust_fraction(const CoclustSamples &samples, double *packed, double threshold, vector<vector<int>> &sparse_rows,
+                             vector<vector<double>> &sparse_x) {
+    // Column col pairs node col with the nodes up to it, in the samples holding it
+    double density = samples.density();
+    vector<double> costs(samples.n);
+    for (int col = 0; col < samples.n; ++col) {
+        costs[col] = 16.0 * samples.samples.size() + 4.0 * (col + 1) * density;
+    }
+    CoclustFractionWorker<T> worker(samples, packed, threshold, sparse_rows, sparse_x);
+    Parallel::parallel_for_costs(costs, worker);
+}
+
+static void reduce_dense(const CoclustSamples &samples, NumericMatrix &cc_mat) {
+    if (cc_mat.nrow() != samples.n || cc_mat.ncol() != samples.n) {
+        Rcpp::stop("cc_mat is not a square matrix");
+    }
+    ReduceCoclustWorker worker(samples, cc_mat);
+    double col_cost = 16.0 * samples.samples.size() + 2.0 * samples.n * samples.density();
+    Parallel::parallel_for(0, samples.n, worker, Parallel::grain(samples.n, col_cost));
 }
 
-void reduce_num_trials_single(const NumericVector& boot_nodes, NumericMatrix& cc_mat){
-    for (int i=0; i < boot_nodes.length(); ++i){
-        NumericMatrix::Column cc_col = cc_mat(_, boot_nodes[i] - 1);
-        for (int j = 0; j < boot_nodes.length(); ++j){
-            cc_col[boot_nodes[j] - 1] = cc_col[boot_nodes[j] - 1] + 1;
-        }   
-    }   
+// [[Rcpp::export]]
+void reduce_coclust(const List& boot_nodes_l, const List& cc_ij_mat_l, NumericMatrix& cc_mat){
+    CoclustSamples samples(boot_nodes_l, &cc_ij_mat_l, cc_mat.ncol());
+    reduce_dense(samples, cc_mat);
 }
 
 // [[Rcpp::export]]
 void reduce_num_trials(const List& boot_nodes_l, NumericMatrix& cc_mat){
-    for (int i=0; i < boot_nodes_l.length(); ++i){
-        reduce_num_trials_single(Rcpp::as<const Rcpp::NumericVector>(boot_nodes_l[i]), cc_mat);
+    CoclustSamples samples(boot_nodes_l, nullptr, cc_mat.ncol());
+    reduce_dense(samples, cc_mat);
+}
+
+// The co-clustering fraction of n nodes over the bootstrap samples, as a packed symmetric matrix (dspMatrix), or as a
+// sparse symmetric matrix (dsCMatrix) of the fractions of at least threshold when threshold is not NA. Both hold the
+// upper triangle alone. The counts are 16 bit when no pair can be counted more than 65535 times, 32 bit otherwise.
+// [[Rcpp::export]]
+SEXP coclust_matrix_cpp(const List& boot_nodes_l, const List& cc_ij_mat_l, int n, double threshold) {
+    CoclustSamples samples(boot_nodes_l, &cc_ij_mat_l, n);
+    bool sparse = !ISNAN(threshold);
+
+    NumericVector packed;
+    vector<vector<int>> sparse_rows(sparse ? n : 0);
+    vector<vector<double>> sparse_x(sparse ? n : 0);
+    if (!sparse) {
+        packed = NumericVector(R_xlen_t(n) * (R_xlen_t(n) + 1) / 2);
+    }
+    double *packed_data = sparse ? nullptr : packed.begin();
+
+    double max_count = samples.max_count();
+    if (max_count <= std::numeric_limits<uint16_t>::max()) {
+        coclust_fraction<uint16_t>(samples, packed_data, threshold, sparse_rows, sparse_x);
+    } else if (max_count <= std::numeric_limits<uint32_t>::max()) {
+        coclust_fraction<uint32_t>(samples, packed_data, threshold, sparse_rows, sparse_x);
+    } else {
+        Rcpp::stop("too many bootstrap samples to count");
+    }
+
+    if (!sparse) {
+        S4 out_matrix("dspMatrix");
+        out_matrix.slot("x") = packed;
+        out_matrix.slot("Dim") = IntegerVector::create(n, n);
+        out_matrix.slot("uplo") = "U";
+        return out_matrix;
+    }
+
+    IntegerVector p(n + 1);
+    for (int col = 0; col < n; ++col) {
+        double nnz = double(p[col]) + sparse_rows[col].size();
+        if (nnz > std::numeric_limits<int>::max()) {
+            Rcpp::stop("the sparse co-clustering matrix has more than 2^31 entries, raise the threshold");
+        }
+        p[col + 1] = int(nnz);
     }
+    IntegerVector i(p[n]);
+    NumericVector x(p[n]);
+    for (int col = 0; col < n; ++col) {
+        std::copy(sparse_rows[col].begin(), sparse_rows[col].end(), i.begin() + p[col]);
+        std::copy(sparse_x[col].begin(), sparse_x[col].end(), x.begin() + p[col]);
+        vector<int>().swap(sparse_rows[col]);
+        vector<double>().swap(sparse_x[col]);
+    }
+
+    S4 out_matrix("dsCMatrix");
+    out_matrix.slot("i") = i;
+    out_matrix.slot("p") = p;
+    out_matrix.slot("x") = x;
+    out_matrix.slot("Dim") = IntegerVector::create(n, n);
+    out_matrix.slot("uplo") = "U";
+    return out_matrix;
 }
@@ -0,0 +1,50 @@
+//
+// Per-thread scratch buffers for the hot loops
+//
+
+#ifndef TGLKMEANS_SCRATCH_H
+#define TGLKMEANS_SCRATCH_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// A vector leased from a pool owned by the current thread, for the temporaries of distance, ranking
+// and sampling kernels. The pooled vectors keep their capacity, so once every thread has seen the
+// largest size a kernel needs, leasing does not allocate. Leases nest (a kernel called from inside
+// another one takes its own vector), and are returned to the pool when they go out of scope.
+// The contents of a leased vector are unspecified, only its size is set.
+template<typename T>
+class ScratchVector {
+private:
+    std::vector<T> m_vec;
+
+    static std::vector<std::vector<T>> &pool() {
+        thread_local std::vector<std::vector<T>> free_vectors;
+        return free_vectors;
+    }
+
+public:
+    explicit ScratchVector(size_t size = 0) {
+        std::vector<std::vector<T>> &free_vectors = pool();
+        if (!free_vectors.empty()) {
+            m_vec = std::move(free_vectors.back());
+            free_vectors.pop_back();
+        }
+        m_vec.resize(size);
+    }
+
+    ~ScratchVector() {
+        pool().push_back(std::move(m_vec));
+    }
+
+    ScratchVector(const ScratchVector &) = delete;
+
+    ScratchVector &operator=(const ScratchVector &) = delete;
+
+    std::vector<T> &operator*() { return m_vec; }
+
+    std::vector<T> *operator->() { return &m_vec; }
+};
+
+#endif //TGLKMEANS_SCRATCH_H
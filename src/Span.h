@@ -0,0 +1,47 @@
+//
+// A typed view over contiguous memory owned by someone else
+//
+
+#ifndef TGLKMEANS_SPAN_H
+#define TGLKMEANS_SPAN_H
+
+#include <cstddef>
+#include <vector>
+
+// Lets the column kernels read and write the columns of R matrices and vectors in place (and scratch
+// vectors alike), instead of copying every column into a std::vector and the results back.
+template<typename T>
+class Span {
+private:
+    T *m_data;
+    size_t m_size;
+
+public:
+    Span() : m_data(nullptr), m_size(0) {}
+
+    Span(T *data, size_t size) : m_data(data), m_size(size) {}
+
+    Span(T *begin, T *end) : m_data(begin), m_size(end - begin) {}
+
+    template<typename V>
+    Span(std::vector<V> &vec) : m_data(vec.data()), m_size(vec.size()) {}
+
+    template<typename V>
+    Span(const std::vector<V> &vec) : m_data(vec.data()), m_size(vec.size()) {}
+
+    size_t size() const { return m_size; }
+
+    bool empty() const { return m_size == 0; }
+
+    T *data() const { return m_data; }
+
+    T *begin() const { return m_data; }
+
+    T *end() const { return m_data + m_size; }
+
+    T &operator[](size_t i) const { return m_data[i]; }
+
+    Span subspan(size_t offset, size_t size) const { return Span(m_data + offset, size); }
+};
+
+#endif //TGLKMEANS_SPAN_H
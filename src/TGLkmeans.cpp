@@ -7,10 +7,14 @@
 #include <Rcpp.h>
 #include <memory>
 #include "KMeans.h"
+#include "KMeansCoreset.h"
+#include "KMeansHierarchical.h"
+#include "KMeansSweep.h"
+#include "ClusterQuality.h"
+#include "Cancellation.h"
+#include "Parallel.h"
+#include "KMeansCenterFactory.h"
 #include "Random.h"
-#include "KMeansCenterMeanEuclid.h"
-#include "KMeansCenterMeanPearson.h"
-#include "KMeansCenterMeanSpearman.h"
 
 using namespace Rcpp;
 using namespace std;
@@ -48,55 +52,259 @@ void real_max_to_na(DataFrame& df){
     }
 }
 
+// Encodes the columns of df (the observations) without going through a float copy
+unique_ptr<KMeansData> df2quantized(const DataFrame& df, DataPrecision precision){
+    size_t n = df.ncol();
+    size_t dim = NumericVector(df[0]).size();
+    auto data = make_unique<KMeansDataQuantized>(n, dim, precision);
+    if (precision == DataPrecision::int8){
+        for (size_t i = 0; i < n; ++i){
+            NumericVector col = df[i];
+            data->update_range(col.begin());
+        }
+    }
+    for (size_t i = 0; i < n; ++i){
+        NumericVector col = df[i];
+        if (precision == DataPrecision::float16){
+            // Larger values would all be clamped to the largest float16, which changes the distances
+            for (double val : col){
+                if (val != REAL_MAX && std::abs(val) > KMeansDataQuantized::FLOAT16_MAX){
+                    stop("data values must be within +-65504 for data_precision 'float16', use 'bfloat16', 'int8' or 'float32' instead");
+                }
+            }
+        }
+        data->set_row(i, col.begin());
+    }
+    return data;
+}
+
+// Encodes mat (NAs already replaced) at the given precision. float_data holds the float32 rows and
+// must outlive the returned data.
+unique_ptr<KMeansData> mat2data(DataFrame& mat, const String& data_precision, vector<vector<float> >& float_data){
+    if (data_precision == "float32") {
+        float_data = as<vector<vector<float> > >(mat);
+        return make_unique<KMeansDataFloat>(float_data);
+    }
+    return df2quantized(mat, KMeansDataQuantized::parse_precision(data_precision.get_cstring()));
+}
+
 // [[Rcpp::export]]
-List TGL_kmeans_cpp(const StringVector& ids, DataFrame& mat, const int& k, const String& metric, const double& max_iter=40, const double& min_delta=0.0001, const bool& use_cpp_random=false, const int& seed=-1){
+List TGL_kmeans_cpp(const StringVector& ids, DataFrame& mat, const int& k, const String& metric, const double& max_iter=40, const double& min_delta=0.0001, const bool& use_cpp_random=false, const int& seed=-1, const double& coreset_size=0, const String& data_precision="float32", const bool& hierarchical=false, const int& refine_iter=0, const double& time_limit=0, const bool& margins=false){
 
     if (use_cpp_random){
         Random::seed(seed);
     }
     replace_na(mat);
 
-    vector<vector<float> > data = as<vector<vector<float> > >(mat);
+    vector<vector<float> > float_data;
+    unique_ptr<KMeansData> data = mat2data(mat, data_precision, float_data);
+
+    int dim = data->dim();
+    vector<unique_ptr<KMeansCenterBase>> owned_centers;
+    vector<KMeansCenterBase *> centers;
+    create_centers(metric.get_cstring(), k, dim, owned_centers, centers);
 
-    int dim = data[0].size();
-    vector<unique_ptr<KMeansCenterBase>> owned_centers(k);
+    vector<int> assignments;
+    vector<vector<float> > centers_float;
+    vector<int> tree_node, tree_parent, tree_size, tree_clust;
+    bool converged = false;
+    AssignmentMargins row_margins;
 
-    if (metric == "euclid") {
-        for (int i = 0; i < k; i++) {
-            owned_centers[i] = make_unique<KMeansCenterMeanEuclid>(dim);
+    // Started before the coreset, so that the time limit covers building and clustering it. The final labeling of all
+    // the rows of a coreset run always completes once it started, but it still stops on a user interrupt.
+    CancellationToken token(time_limit);
+
+    // Clusters the given rows (either all the data or the coreset rows), and fills run_margins if given
+    auto run_kmeans = [&](const KMeansData& cluster_data, const vector<float>& weights, AssignmentMargins* run_margins) {
+        if (hierarchical) {
+            KMeansHierarchical kmeans(cluster_data, k, centers, metric.get_cstring(), use_cpp_random, weights);
+            kmeans.set_cancellation(&token);
+            kmeans.cluster(max_iter, min_delta, refine_iter);
+            converged = kmeans.converged();
+            kmeans.report_centers_to_vector(centers_float);
+            kmeans.report_tree(tree_node, tree_parent, tree_size, tree_clust);
+            assignments = kmeans.report_assignment_to_vector();
+            if (run_margins != nullptr) {
+                // The leaves are not necessarily the closest centers of their rows
+                KMeans::assignment_margins(cluster_data, centers, assignments, *run_margins);
+            }
+        } else {
+            KMeans kmeans(cluster_data, k, centers, use_cpp_random, weights);
+            kmeans.set_cancellation(&token);
+            kmeans.set_margins(run_margins);
+            kmeans.cluster(max_iter, min_delta);
+            converged = kmeans.converged();
+            kmeans.report_centers_to_vector(centers_float);
+            assignments = kmeans.report_assignment_to_vector();
         }
-    } else if (metric == "pearson") {
-        for (int i = 0; i < k; i++) {
-            owned_centers[i] = make_unique<KMeansCenterMeanPearson>(dim);
+    };
+
+    if (coreset_size > 0 && coreset_size < data->size()) {
+        // Cluster a weighted sample of the rows and then label all the rows by the resulting centers
+        vector<unique_ptr<KMeansCenterBase>> owned_bicriteria_centers;
+        vector<KMeansCenterBase *> bicriteria_centers;
+        create_centers(metric.get_cstring(), k, dim, owned_bicriteria_centers, bicriteria_centers);
+
+        KMeansCoreset coreset(*data, bicriteria_centers, use_cpp_random);
+        coreset.set_cancellation(&token);
+        coreset.build(coreset_size);
+
+        vector<vector<float> > coreset_data;
+        coreset.report_data(coreset_data);
+        if (coreset_data.size() < (size_t)k) {
+            stop("coreset has fewer distinct rows than k, increase coreset_size");
         }
-    } else if (metric == "spearman") {
-        for (int i = 0; i < k; i++) {
-            owned_centers[i] = make_unique<KMeansCenterMeanSpearman>(dim);
+
+        KMeansDataFloat coreset_rows(coreset_data);
+        run_kmeans(coreset_rows, coreset.weights(), nullptr);
+
+        Rcpp::Rcout << "assigning all rows to coreset centers" << endl;
+        run_cancellable(token, [&]() { assignments = KMeans::assign(*data, centers, margins ? &row_margins : nullptr, &token); });
+        token.check_interrupt();
+        if (hierarchical) {
+            // The tree sizes were counted on the coreset rows
+            vector<int> leaf_size(k, 0);
+            for (int clust : assignments) {
+                leaf_size[clust]++;
+            }
+            for (int i = tree_node.size() - 1; i >= 0; i--) {
+                tree_size[i] = tree_clust[i] >= 0 ? leaf_size[tree_clust[i]] : 0;
+            }
+            for (int i = tree_node.size() - 1; i > 0; i--) {
+                tree_size[tree_parent[i]] += tree_size[i];
+            }
         }
     } else {
-        stop("possible metrics are 'euclid', 'pearson' and 'spearman'");
+        run_kmeans(*data, vector<float>(), margins ? &row_margins : nullptr);
     }
 
-    vector<KMeansCenterBase *> centers(k);
-    for (int i = 0; i < k; i++) {
-        centers[i] = owned_centers[i].get();
-    }
-
-    KMeans kmeans(data, k, centers, use_cpp_random);
-
-    kmeans.cluster(max_iter, min_delta);
-
-    vector<vector<float> > centers_float;
-    kmeans.report_centers_to_vector(centers_float);
     DataFrame centers_df;
     vec2df(centers_float, centers_df);
 
     real_max_to_na(centers_df);
 
-    vector<int> assignments = kmeans.report_assignment_to_vector();
     DataFrame clust_df = DataFrame::create( Named("id") = ids, _["clust"] = NumericVector::import(assignments.begin(), assignments.end()), _["stringsAsFactors"] = false);
+    if (margins) {
+        NumericVector dist(row_margins.dist.begin(), row_margins.dist.end());
+        NumericVector second(row_margins.second.begin(), row_margins.second.end());
+        NumericVector second_dist(row_margins.second_dist.begin(), row_margins.second_dist.end());
+        for (int i = 0; i < dist.size(); ++i){
+            if (dist[i] == REAL_MAX){
+                dist[i] = NA_REAL;
+            }
+            if (second[i] < 0){
+                second[i] = NA_REAL;
+                second_dist[i] = NA_REAL;
+            }
+        }
+        clust_df = DataFrame::create( Named("id") = ids, _["clust"] = clust_df["clust"], _["dist"] = dist, _["second_clust"] = second, _["second_dist"] = second_dist, _["stringsAsFactors"] = false);
+    }
+
+    List res = List::create(Named("centers") = centers_df, _["cluster"] = clust_df, _["converged"] = converged);
 
-    List res = List::create(Named("centers") = centers_df, _["cluster"] = clust_df);
+    if (hierarchical) {
+        IntegerVector parent(tree_parent.begin(), tree_parent.end());
+        IntegerVector clust(tree_clust.begin(), tree_clust.end());
+        for (int i = 0; i < parent.size(); ++i){
+            if (parent[i] < 0){
+                parent[i] = NA_INTEGER;
+            }
+            if (clust[i] < 0){
+                clust[i] = NA_INTEGER;
+            }
+        }
+        res["tree"] = DataFrame::create(Named("node") = wrap(tree_node), _["parent"] = parent, _["size"] = wrap(tree_size), _["clust"] = clust);
+    }
 
     return(res);
 }
+
+// [[Rcpp::export]]
+List TGL_kmeans_sweep_cpp(DataFrame& mat, const IntegerVector& ks, const String& metric, const double& max_iter=40, const double& min_delta=0.0001, const bool& use_cpp_random=false, const int& seed=-1, const String& data_precision="float32", const double& time_limit=0){
+
+    if (use_cpp_random){
+        Random::seed(seed);
+    }
+    replace_na(mat);
+
+    vector<vector<float> > float_data;
+    unique_ptr<KMeansData> data = mat2data(mat, data_precision, float_data);
+
+    CancellationToken token(time_limit);
+    KMeansSweep sweep(*data, as<vector<int> >(ks), metric.get_cstring(), use_cpp_random);
+    sweep.set_cancellation(&token);
+    sweep.cluster(max_iter, min_delta);
+
+    const vector<KMeansSweep::Result>& results = sweep.results();
+    NumericVector objective(results.size());
+    LogicalVector converged(results.size());
+    List cluster(results.size());
+    List size(results.size());
+    for (size_t i = 0; i < results.size(); ++i){
+        objective[i] = results[i].objective;
+        converged[i] = results[i].converged;
+        cluster[i] = IntegerVector(results[i].assignment.begin(), results[i].assignment.end());
+        size[i] = IntegerVector(results[i].size.begin(), results[i].size.end());
+    }
+
+    return List::create(Named("k") = ks, _["objective"] = objective, _["converged"] = converged, _["cluster"] = cluster, _["size"] = size);
+}
+
+// [[Rcpp::export]]
+IntegerVector predict_kmeans_cpp(DataFrame& mat, DataFrame& centers_mat, const String& metric){
+    // Columns of mat are the observations and columns of centers_mat are the centers
+    replace_na(mat);
+    replace_na(centers_mat);
+
+    vector<vector<float> > float_data = as<vector<vector<float> > >(mat);
+    KMeansDataFloat data(float_data);
+    vector<vector<float> > center_coords = as<vector<vector<float> > >(centers_mat);
+
+    vector<unique_ptr<KMeansCenterBase>> owned_centers;
+    vector<KMeansCenterBase *> centers;
+    create_centers(metric.get_cstring(), center_coords.size(), data.dim(), owned_centers, centers);
+    for (size_t i = 0; i < centers.size(); ++i){
+        // A single vote sets the center to the given coordinates (missing coordinates stay missing)
+        centers[i]->vote(center_coords[i], 1);
+        centers[i]->init_to_votes();
+    }
+
+    vector<int> assignments = KMeans::assign(data, centers);
+    return IntegerVector(assignments.begin(), assignments.end());
+}
+
+// [[Rcpp::export]]
+List cluster_quality_cpp(DataFrame& mat, DataFrame& centers_mat, const IntegerVector& assignment, const String& metric, const NumericVector& sample){
+    // Columns of mat are the observations and columns of centers_mat are the centers. assignment and
+    // sample (the rows of the sampled silhouette) are 0 based.
+    replace_na(mat);
+    replace_na(centers_mat);
+
+    vector<vector<float> > float_data = as<vector<vector<float> > >(mat);
+    KMeansDataFloat data(float_data);
+    vector<vector<float> > center_coords = as<vector<vector<float> > >(centers_mat);
+
+    vector<unique_ptr<KMeansCenterBase>> owned_centers;
+    vector<KMeansCenterBase *> centers;
+    create_centers(metric.get_cstring(), center_coords.size(), data.dim(), owned_centers, centers);
+    for (size_t i = 0; i < centers.size(); ++i){
+        centers[i]->vote(center_coords[i], 1);
+        centers[i]->init_to_votes();
+    }
+
+    vector<int> clust(assignment.begin(), assignment.end());
+    vector<size_t> sample_rows(sample.begin(), sample.end());
+    ClusterQuality quality = cluster_quality(data, centers, metric.get_cstring(), clust, sample_rows);
+
+    return List::create(Named("simplified_silhouette") = quality.simplified_silhouette, _["silhouette"] = quality.silhouette, _["davies_bouldin"] = quality.davies_bouldin, _["calinski_harabasz"] = quality.calinski_harabasz);
+}
+
+// [[Rcpp::export]]
+void set_parallel_cpp(const int& max_threads, const int& r_workers, const double& grain_size=0, const bool& affinity=false){
+    Parallel::configure(max_threads, r_workers, grain_size > 0 ? (size_t) grain_size : 0, affinity);
+}
+
+// [[Rcpp::export]]
+List get_parallel_cpp(){
+    return List::create(Named("thread_num") = Parallel::max_threads(), _["r_workers"] = Parallel::r_workers(), _["native_threads"] = Parallel::threads(), _["forked"] = Parallel::forked(), _["grain_size"] = (double) Parallel::fixed_grain(), _["affinity"] = Parallel::affinity());
+}
@@ -0,0 +1,30 @@
+//
+// Parallel worker for turning the votes of the centers into new centers
+//
+
+#ifndef UPDATECENTERSWORKER_H
+#define UPDATECENTERSWORKER_H
+
+#include <RcppParallel.h>
+#include "KMeansCenterBase.h"
+#include <vector>
+
+// Centers are independent, so init_to_votes (including the center statistics of the
+// correlation metrics) runs in parallel over the centers.
+class UpdateCentersWorker : public RcppParallel::Worker {
+private:
+    std::vector<KMeansCenterBase*>& centers;
+
+public:
+    UpdateCentersWorker(std::vector<KMeansCenterBase*>& centers)
+        : centers(centers) {}
+
+    void operator()(std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            centers[i]->init_to_votes();
+            centers[i]->reset_votes();
+        }
+    }
+};
+
+#endif // UPDATECENTERSWORKER_H
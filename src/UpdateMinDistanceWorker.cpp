@@ -1,27 +1,52 @@
 #include "UpdateMinDistanceWorker.h"
+#include "Scratch.h"
 
 using namespace std;
 
-UpdateMinDistanceWorker::UpdateMinDistanceWorker(const vector<vector<float>>& data,
+UpdateMinDistanceWorker::UpdateMinDistanceWorker(const KMeansData& data,
                                                  KMeansCenterBase* new_center,
-                                                 vector<pair<float, int>>& min_dist,
-                                                 const vector<int>& assignment)
-    : data(data), new_center(new_center), min_dist(min_dist), assignment(assignment) {}
+                                                 vector<float>& min_dist,
+                                                 const vector<int>& assignment,
+                                                 const CancellationToken* token)
+    : data(data), new_center(new_center), min_dist(min_dist), assignment(assignment), token(token),
+      min_center(nullptr), new_center_i(-1), center_dist(nullptr) {}
+
+void UpdateMinDistanceWorker::set_pruning(vector<int>* min_center, int new_center_i, const vector<float>* center_dist) {
+    this->min_center = min_center;
+    this->new_center_i = new_center_i;
+    this->center_dist = center_dist;
+}
 
 void UpdateMinDistanceWorker::operator()(std::size_t begin, std::size_t end) {
+    ScratchVector<float> scratch;
+    vector<float> &buf = *scratch;
     for (std::size_t i = begin; i < end; ++i) {
+        if (token && token->cancelled()) {
+            return;
+        }
         if (assignment[i] != -1) {
             // Mark assigned points with sentinel (below any valid distance including negative correlations)
-            min_dist[i] = std::make_pair(-REAL_MAX, (int)i);
+            min_dist[i] = -REAL_MAX;
             continue;
         }
 
+        if (min_center != nullptr && (*min_center)[i] >= 0 && data.complete(i)) {
+            float centers_dist = (*center_dist)[(*min_center)[i]];
+            if (centers_dist >= 0 && centers_dist > 2 * min_dist[i] * (1 + PRUNE_SLACK)) {
+                // The new center is farther than the current one, min_dist[i] would not change
+                continue;
+            }
+        }
+
         // Incremental: only check distance to NEW center
-        float dist = new_center->dist(data[i]);
+        float dist = new_center->dist(data.row(i, buf), data.na_mask(i));
 
         // Update only if new center is closer
-        if (dist < min_dist[i].first) {
-            min_dist[i] = std::make_pair(dist, (int)i);
+        if (dist < min_dist[i]) {
+            min_dist[i] = dist;
+            if (min_center != nullptr) {
+                (*min_center)[i] = new_center_i;
+            }
         }
     }
 }
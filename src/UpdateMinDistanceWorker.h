@@ -4,20 +4,37 @@
 // [[Rcpp::depends(RcppParallel)]]
 #include <RcppParallel.h>
 #include "KMeansCenterBase.h"
+#include "KMeansData.h"
+#include "Cancellation.h"
 #include <vector>
 
 class UpdateMinDistanceWorker : public RcppParallel::Worker {
 private:
-    const std::vector<std::vector<float>>& data;
+    const KMeansData& data;
     KMeansCenterBase* new_center;
-    std::vector<std::pair<float, int>>& min_dist;
+    std::vector<float>& min_dist;
     const std::vector<int>& assignment;
+    const CancellationToken* token;
+
+    // Triangle inequality pruning (euclid), nullptr disables it: the center of each min_dist (-1 if none),
+    // and the distance of every earlier center to the new one (negative when it cannot be used)
+    std::vector<int>* min_center;
+    int new_center_i;
+    const std::vector<float>* center_dist;
 
 public:
-    UpdateMinDistanceWorker(const std::vector<std::vector<float>>& data,
+    // Relative margin of the pruning bound, so that float rounding never skips a closer center
+    static constexpr float PRUNE_SLACK = 1e-4;
+
+    UpdateMinDistanceWorker(const KMeansData& data,
                             KMeansCenterBase* new_center,
-                            std::vector<std::pair<float, int>>& min_dist,
-                            const std::vector<int>& assignment);
+                            std::vector<float>& min_dist,
+                            const std::vector<int>& assignment,
+                            const CancellationToken* token = nullptr);
+
+    // Rows whose nearest center c is far from the new one, d(c, new) > 2 * min_dist, cannot get closer
+    // and are skipped. Valid for complete rows and centers under the euclid metric.
+    void set_pruning(std::vector<int>* min_center, int new_center_i, const std::vector<float>* center_dist);
 
     void operator()(std::size_t begin, std::size_t end);
 };
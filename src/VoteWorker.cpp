@@ -0,0 +1,38 @@
+#include <algorithm>
+#include "VoteWorker.h"
+#include "Scratch.h"
+
+using namespace std;
+
+VoteWorker::VoteWorker(const KMeansData& data,
+                       vector<KMeansCenterBase*>& centers,
+                       const vector<size_t>& rows,
+                       const vector<size_t>& offsets,
+                       const vector<float>& weights)
+    : data(data), centers(centers), rows(rows), offsets(offsets), weights(weights) {
+    size_t dim = data.dim();
+    size_t max_blocks = max<size_t>(1, dim / MIN_BLOCK_DIM);
+    blocks = centers.empty() ? 1 : min(max_blocks, (MIN_TASKS + centers.size() - 1) / centers.size());
+    blocks = max<size_t>(blocks, 1);
+    block_dim = (dim + blocks - 1) / blocks;
+}
+
+void VoteWorker::operator()(std::size_t begin, std::size_t end) {
+    ScratchVector<float> scratch;
+    vector<float> &buf = *scratch;
+    for (size_t task = begin; task < end; task++) {
+        size_t center_i = task / blocks;
+        size_t dim_begin = (task % blocks) * block_dim;
+        size_t dim_end = min(dim_begin + block_dim, data.dim());
+        if (dim_begin >= dim_end) {
+            continue;
+        }
+        for (size_t k = offsets[center_i]; k < offsets[center_i + 1]; k++) {
+            size_t j = rows[k];
+            float wgt = weights.empty() ? 1 : weights[j];
+            if (wgt > 0) {
+                centers[center_i]->vote(data.row(j, buf), wgt, data.na_mask(j), dim_begin, dim_end);
+            }
+        }
+    }
+}
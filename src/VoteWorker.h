@@ -0,0 +1,40 @@
+//
+// Parallel worker for voting rows to their centers
+//
+
+#ifndef VOTEWORKER_H
+#define VOTEWORKER_H
+
+#include <RcppParallel.h>
+#include "KMeansCenterBase.h"
+#include "KMeansData.h"
+#include <vector>
+
+// Every task votes the rows of a single center to a block of its dimensions. Centers are
+// split to dimension blocks only when there are too few centers to keep the threads busy.
+class VoteWorker : public RcppParallel::Worker {
+private:
+    static const size_t MIN_TASKS = 64;
+    static const size_t MIN_BLOCK_DIM = 256;
+
+    const KMeansData& data;
+    std::vector<KMeansCenterBase*>& centers;
+    const std::vector<size_t>& rows;        // rows of center i are rows[offsets[i]..offsets[i + 1])
+    const std::vector<size_t>& offsets;
+    const std::vector<float>& weights;   // Per-row vote weights (empty means 1)
+    size_t blocks;
+    size_t block_dim;
+
+public:
+    VoteWorker(const KMeansData& data,
+               std::vector<KMeansCenterBase*>& centers,
+               const std::vector<size_t>& rows,
+               const std::vector<size_t>& offsets,
+               const std::vector<float>& weights);
+
+    size_t tasks() const { return centers.size() * blocks; }
+
+    void operator()(std::size_t begin, std::size_t end);
+};
+
+#endif // VOTEWORKER_H
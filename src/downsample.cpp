@@ -1,47 +1,266 @@
+#include <algorithm>
+#include <climits>
+#include <future>
+#include <stdexcept>
 #include <vector>
 #include <Rcpp.h>
 #include <RcppParallel.h>
+#include "CscFile.h"
 #include "DownsampleWorker.h"
+#include "Parallel.h"
 
 typedef float float32_t;
 typedef double float64_t;
 typedef unsigned char uint8_t;
 typedef unsigned int uint_t;
 
-// [[Rcpp::export]]
-Rcpp::IntegerMatrix downsample_matrix_cpp(Rcpp::IntegerMatrix input, int samples, unsigned int random_seed) {
-    Rcpp::IntegerMatrix output(input.nrow(), input.ncol());
+// targets with the same target for every column
+static Rcpp::IntegerMatrix single_target(int ncols, int samples) {
+    Rcpp::IntegerMatrix targets(1, ncols);
+    std::fill(targets.begin(), targets.end(), samples);
+    return targets;
+}
 
-    DownsampleWorker worker(input, output, samples, random_seed);
-    RcppParallel::parallelFor(0, input.ncol(), worker);
+// The downsampled matrix, the sums of the non NA values of its input columns, and whether they are below the target
+static Rcpp::List downsample_result(SEXP output, const Rcpp::NumericVector& sums, int samples) {
+    Rcpp::LogicalVector small(sums.size());
+    for (int col = 0; col < sums.size(); ++col) {
+        small[col] = sums[col] < samples;
+    }
+    return Rcpp::List::create(Rcpp::Named("mat") = output, Rcpp::Named("sums") = sums, Rcpp::Named("small") = small);
+}
 
-    return output;
+// The estimated cost of every column of a sparse matrix (or block) with column offsets p, downsampled to the
+// targets of its levels, given by target(level, col). Columns range from a handful of entries in empty droplets
+// to tens of thousands in deep cells, so the sparse loops schedule their columns by cost
+// (Parallel::parallel_for_costs) rather than by count.
+template<typename Offsets, typename Targets>
+static std::vector<double> column_costs(const Offsets& p, size_t ncols, int levels, const Targets& target,
+                                        DownsampleMethod method) {
+    std::vector<double> costs(ncols, 0);
+    for (size_t col = 0; col < ncols; ++col) {
+        int64_t entries = int64_t(p[col + 1]) - int64_t(p[col]);
+        for (int level = 0; level < levels; ++level) {
+            costs[col] += downsample_column_cost(entries, target(level, col), method);
+        }
+    }
+    return costs;
 }
 
-// [[Rcpp::export]]
-Rcpp::S4 rcpp_downsample_sparse(Rcpp::S4 matrix, int samples, unsigned int random_seed) {
+// Downsamples the columns of input (an Rcpp matrix of counts of type D) to every level (row) of targets, and returns
+// the list of the matrices of the levels
+template<typename D, typename InputMatrix>
+static Rcpp::List downsample_dense_typed(const InputMatrix& input, const Rcpp::IntegerMatrix& targets, Rcpp::NumericVector& sums,
+                                         unsigned int random_seed, const std::string& method) {
+    std::vector<Rcpp::IntegerMatrix> outputs;
+    for (int level = 0; level < targets.nrow(); ++level) {
+        outputs.emplace_back(input.nrow(), input.ncol());
+    }
+
+    DownsampleWorker<D> worker(RcppParallel::RMatrix<D>(input), targets, outputs, sums, random_seed, parse_downsample_method(method));
+    Parallel::parallel_for(0, input.ncol(), worker, Parallel::grain(input.ncol(), 4.0 * input.nrow() * targets.nrow()));
+
+    Rcpp::List mats(outputs.size());
+    for (size_t level = 0; level < outputs.size(); ++level) {
+        mats[level] = outputs[level];
+    }
+    return mats;
+}
+
+// Double matrices are read in place rather than converted to integers, other types (integer, logical) as integers
+static Rcpp::List downsample_dense(SEXP input, const Rcpp::IntegerMatrix& targets, Rcpp::NumericVector& sums,
+                                   unsigned int random_seed, const std::string& method) {
+    if (TYPEOF(input) == REALSXP) {
+        return downsample_dense_typed<float64_t>(Rcpp::NumericMatrix(input), targets, sums, random_seed, method);
+    }
+    return downsample_dense_typed<int>(Rcpp::IntegerMatrix(input), targets, sums, random_seed, method);
+}
+
+// The same for a dgCMatrix, returning a dgCMatrix per level without the entries that were downsampled to zero
+static Rcpp::List downsample_sparse(const Rcpp::S4& matrix, const Rcpp::IntegerMatrix& targets, Rcpp::NumericVector& sums,
+                                    unsigned int random_seed, const std::string& method) {
     // Extract components of the dgCMatrix
     Rcpp::IntegerVector i = matrix.slot("i");
     Rcpp::IntegerVector p = matrix.slot("p");
-    Rcpp::IntegerVector x = matrix.slot("x");
+    Rcpp::NumericVector x = matrix.slot("x");
 
     int nrows = Rcpp::as<Rcpp::IntegerVector>(matrix.slot("Dim"))[0];
     int ncols = Rcpp::as<Rcpp::IntegerVector>(matrix.slot("Dim"))[1];
 
-    // Prepare output vector
-    Rcpp::IntegerVector out_x(x.size());
+    // Downsampled value of every stored entry, and the number of non zeros left in every column, per level
+    std::vector<Rcpp::IntegerVector> out_x;
+    std::vector<Rcpp::IntegerVector> out_p;
+    for (int level = 0; level < targets.nrow(); ++level) {
+        out_x.emplace_back(x.size());
+        out_p.emplace_back(ncols + 1);
+    }
 
     // Create and run the DownsampleWorkerSparse
-    DownsampleWorkerSparse worker(i, p, x, out_x, samples, random_seed);
-    RcppParallel::parallelFor(0, ncols, worker);
+    DownsampleMethod parsed_method = parse_downsample_method(method);
+    DownsampleWorkerSparse worker(i, p, x, targets, out_x, out_p, sums, random_seed, parsed_method);
+    Parallel::parallel_for_costs(column_costs(p, ncols, targets.nrow(), targets, parsed_method), worker);
 
-    // Create a new dgCMatrix object for the output
-    Rcpp::S4 out_matrix("dgCMatrix");
-    out_matrix.slot("i") = i;
-    out_matrix.slot("p") = p;    
-    Rcpp::NumericVector out_x_double = Rcpp::as<Rcpp::NumericVector>(out_x);
-    out_matrix.slot("x") = out_x_double;
-    out_matrix.slot("Dim") = Rcpp::IntegerVector::create(nrows, ncols);
+    Rcpp::List mats(out_x.size());
+    for (size_t level = 0; level < out_x.size(); ++level) {
+        // Drop the entries that were downsampled to zero
+        Rcpp::IntegerVector& level_p = out_p[level];
+        for (int col = 0; col < ncols; ++col) {
+            level_p[col + 1] += level_p[col];
+        }
+        Rcpp::IntegerVector compact_i(level_p[ncols]);
+        Rcpp::NumericVector compact_x(level_p[ncols]);
+        CompactSparseWorker compact(i, p, out_x[level], level_p, compact_i, compact_x);
+        Parallel::parallel_for(0, ncols, compact, Parallel::grain(ncols, 2.0 * x.size() / std::max(ncols, 1)));
+        out_x[level] = Rcpp::IntegerVector();
 
+        // Create a new dgCMatrix object for the output. Matrix has no integer valued sparse class, so the values are
+        // stored as doubles, written directly to the compacted slot.
+        Rcpp::S4 out_matrix("dgCMatrix");
+        out_matrix.slot("i") = compact_i;
+        out_matrix.slot("p") = level_p;
+        out_matrix.slot("x") = compact_x;
+        out_matrix.slot("Dim") = Rcpp::IntegerVector::create(nrows, ncols);
+        mats[level] = out_matrix;
+    }
+    return mats;
+}
+
+// [[Rcpp::export]]
+Rcpp::List downsample_matrix_cpp(SEXP input, int samples, unsigned int random_seed, const std::string &method = "tree") {
+    int ncols = Rf_ncols(input);
+    Rcpp::NumericVector sums(ncols);
+    Rcpp::List mats = downsample_dense(input, single_target(ncols, samples), sums, random_seed, method);
+    return downsample_result(mats[0], sums, samples);
+}
+
+// [[Rcpp::export]]
+Rcpp::List rcpp_downsample_sparse(Rcpp::S4 matrix, int samples, unsigned int random_seed, const std::string &method = "tree") {
+    int ncols = Rcpp::as<Rcpp::IntegerVector>(matrix.slot("Dim"))[1];
+    Rcpp::NumericVector sums(ncols);
+    Rcpp::List mats = downsample_sparse(matrix, single_target(ncols, samples), sums, random_seed, method);
+    return downsample_result(mats[0], sums, samples);
+}
+
+// targets has a row per level and a column per column of the input. Returns the list of the downsampled matrices of
+// the levels (dense or dgCMatrix, as the input), and the sums of the non NA values of the input columns.
+// [[Rcpp::export]]
+Rcpp::List downsample_matrix_multi_cpp(SEXP input, Rcpp::IntegerMatrix targets, unsigned int random_seed,
+                                       const std::string &method = "tree") {
+    Rcpp::List mats;
+    Rcpp::NumericVector sums(targets.ncol());
+    if (Rf_isS4(input)) {
+        mats = downsample_sparse(Rcpp::S4(input), targets, sums, random_seed, method);
+    } else {
+        mats = downsample_dense(input, targets, sums, random_seed, method);
+    }
+    return Rcpp::List::create(Rcpp::Named("mats") = mats, Rcpp::Named("sums") = sums);
+}
+
+// Appends the entries of a downsampled block that are still non zero to the output file
+static void write_block(CscFileWriter& writer, const CscBlock& block, const std::vector<int32_t>& values,
+                        const std::vector<int64_t>& col_nnz, std::vector<CscEntry>& entries) {
+    entries.clear();
+    for (size_t idx = 0; idx < values.size(); ++idx) {
+        if (values[idx] != 0) {
+            entries.push_back(CscEntry{block.i[idx], values[idx]});
+        }
+    }
+    writer.append(std::vector<int64_t>(col_nnz.begin() + 1, col_nnz.end()), entries);
+}
+
+// Downsamples the columns of a CSC file (see CscFile.h) to the output file, a block of about block_nnz entries at a
+// time. The columns get the same seeds as in memory, so the result is the same as downsampling the whole matrix.
+// The next block is read and the previous one written while a block is downsampled. Returns the sums of the non NA
+// values of the input columns.
+// [[Rcpp::export]]
+Rcpp::NumericVector downsample_csc_file_cpp(std::string input_path, std::string output_path, int samples, unsigned int random_seed,
+                                            const std::string &method, double block_nnz) {
+    DownsampleMethod parsed_method = parse_downsample_method(method);
+    CscFileReader reader(input_path);
+    CscFileWriter writer(output_path, reader.nrow());
+    std::vector<std::pair<size_t, size_t>> blocks = reader.plan_blocks(std::max(1.0, block_nnz));
+    std::vector<double> sums(reader.ncol());
+    auto block_target = [&](int, size_t) { return samples; };
+
+    // The rows of a block are read by its writer, so the input has a buffer more than the output
+    CscBlock input[3];
+    std::vector<int32_t> values[2];
+    std::vector<int64_t> col_nnz[2];
+    std::vector<CscEntry> entries;
+
+    std::future<void> reading;
+    std::future<void> writing;
+    if (!blocks.empty()) {
+        reading = std::async(std::launch::async, [&]() { reader.read_block(blocks[0].first, blocks[0].second, input[0]); });
+    }
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        reading.get();
+        if (b + 1 < blocks.size()) {
+            reading = std::async(std::launch::async,
+                                 [&, b]() { reader.read_block(blocks[b + 1].first, blocks[b + 1].second, input[(b + 1) % 3]); });
+        }
+
+        const CscBlock& block = input[b % 3];
+        values[b % 2].assign(block.x.size(), 0);
+        col_nnz[b % 2].assign(block.ncol() + 1, 0);
+        DownsampleBlockWorker worker(block, values[b % 2], col_nnz[b % 2], sums, samples, random_seed, parsed_method);
+        Parallel::parallel_for_costs(column_costs(block.p, block.ncol(), 1, block_target, parsed_method), worker);
+
+        if (writing.valid()) {
+            writing.get();
+        }
+        writing = std::async(std::launch::async, [&, b]() { write_block(writer, input[b % 3], values[b % 2], col_nnz[b % 2], entries); });
+
+        Rcpp::checkUserInterrupt();
+    }
+    if (writing.valid()) {
+        writing.get();
+    }
+    writer.finish();
+
+    return Rcpp::NumericVector(sums.begin(), sums.end());
+}
+
+// [[Rcpp::export]]
+void write_csc_file_cpp(Rcpp::S4 matrix, std::string path) {
+    Rcpp::IntegerVector i = matrix.slot("i");
+    Rcpp::IntegerVector p = matrix.slot("p");
+    Rcpp::IntegerVector x = matrix.slot("x");
+    Rcpp::IntegerVector dim = matrix.slot("Dim");
+
+    std::vector<int64_t> col_nnz(dim[1]);
+    for (int col = 0; col < dim[1]; ++col) {
+        col_nnz[col] = p[col + 1] - p[col];
+    }
+    std::vector<CscEntry> entries(x.size());
+    for (size_t idx = 0; idx < entries.size(); ++idx) {
+        entries[idx] = CscEntry{i[idx], x[idx]};
+    }
+
+    CscFileWriter writer(path, dim[0]);
+    writer.append(col_nnz, entries);
+    writer.finish();
+}
+
+// [[Rcpp::export]]
+Rcpp::S4 read_csc_file_cpp(std::string path) {
+    CscFileReader reader(path);
+    if (reader.nrow() > INT_MAX || reader.ncol() > INT_MAX || reader.nnz() > INT_MAX) {
+        Rcpp::stop("the matrix in " + path + " is too large for a dgCMatrix");
+    }
+
+    CscBlock block;
+    reader.read_block(0, reader.ncol(), block);
+
+    Rcpp::NumericVector x(block.x.size());
+    for (size_t idx = 0; idx < block.x.size(); ++idx) {
+        x[idx] = block.x[idx] == NA_INTEGER ? NA_REAL : block.x[idx];
+    }
+
+    Rcpp::S4 out_matrix("dgCMatrix");
+    out_matrix.slot("i") = Rcpp::IntegerVector(block.i.begin(), block.i.end());
+    out_matrix.slot("p") = Rcpp::IntegerVector(block.p.begin(), block.p.end());
+    out_matrix.slot("x") = x;
+    out_matrix.slot("Dim") = Rcpp::IntegerVector::create(reader.nrow(), reader.ncol());
     return out_matrix;
-}
\ No newline at end of file
+}